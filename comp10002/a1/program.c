@@ -3,11 +3,47 @@
  * Skeleton code written by Jianzhong Qi, April 2023
  * Edited by: Michael Ren, April 2023
  *
+ * Build with -mavx2 (or -march=native) to enable the AVX2 paths of the
+ * batch lookups, SSE2 is used otherwise on x86-64. Link with -lpthread
+ * for the parallel sort. The keys are ints unless one of -DKEY_INT64,
+ * -DKEY_DOUBLE or -DKEY_STRING is given, see the key types below.
+ * Build with -DSTATS to count the probes and prediction errors of the
+ * lookups, reported with -z, the counters cost nothing otherwise.
+ *
  */
 
+#define _POSIX_C_SOURCE 200809L				  /* for mmap */
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <assert.h>
 #include <math.h>
+#include <time.h>
+#include <limits.h>
+#include <float.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#define PREFETCH(addr) _mm_prefetch((const char*) (addr), _MM_HINT_T0)
+#else
+#define PREFETCH(addr) ((void) (addr))
+#endif
+
+/* statements that only run in builds with -DSTATS */
+#if defined(STATS)
+#define STAT(...) __VA_ARGS__
+#else
+#define STAT(...)
+#endif
 
 #define STAGE_NUM_ONE 1						  /* stage numbers */ 
 #define STAGE_NUM_TWO 2
@@ -15,24 +51,392 @@
 #define STAGE_NUM_FOUR 4
 #define STAGE_HEADER "Stage %d\n==========\n" /* stage header format string */
 
-#define DATASET_SIZE 100					  /* number of input integers */
+#define DATASET_SIZE 100					  /* default number of input integers */
+#define DATASET_MIN 3						  /* smallest dataset stage 3 can index */
 #define DATA_OUTPUT_SIZE 10					  /* output size for stage 1 */
+#define INIT_CAPACITY 16					  /* initial size of growable arrays */
 
 #define BS_NOT_FOUND (-1)					  /* used by binary search */
 #define BS_FOUND 0
 
+#define SEG_GREEDY 0						  /* stage 3 segmentation engines */
+#define SEG_CONE 1
+#define PLA_SCALE 8							  /* position scale of the optimal fit */
+#define ERR_CAP 1000000000000000000LL		  /* prediction errors are capped here */
+
+#define CACHE_LINE 64						  /* bytes per cache line */
+#define ROOT_KEYS (CACHE_LINE / (int) sizeof(data_t)) /* keys in the root level */
+#define LEVEL_ERR 4							  /* max error of the upper levels */
+
+#define BATCH_GROUP 8						  /* keys searched in lockstep by batches */
+#define PIPE_GROUP 16						  /* keys in flight in the pipelined lookups */
+#define PREFETCH_LINES 8					  /* most cache lines prefetched per window */
+#define SCAN_MAX 32							  /* windows this small are scanned, not searched */
+#define BENCH_HEADER "Benchmark\n==========\n" /* benchmark header */
+
+#define DELTA_MIN 32						  /* smallest update buffer of a segment */
+#define DELTA_RATIO 8						  /* segment keys per buffered update */
+
+#define SORT_AUTO 0							  /* stage 1 sort engines */
+#define SORT_QUICK 1
+#define SORT_RADIX 2
+#define SORT_PARALLEL 3
+#define SORT_PRESORTED 4					  /* picked by SORT_AUTO only */
+#define SORT_SMALL 4096						  /* inputs this small are quick sorted */
+#define SORT_PARALLEL_MIN (1 << 20)			  /* smallest input sorted in parallel */
+#define RADIX_BITS 11						  /* bits sorted per radix pass */
+#define RADIX_SIZE (1 << RADIX_BITS)
+#define SAMPLE_RATE 64						  /* samples per run to pick splitters */
+#define MAX_THREADS 64
+#define TIMING_HEADER "Timing\n==========\n" /* timing header */
+
+#define INPUT_TEXT 0						  /* input formats */
+#define INPUT_BINARY 1
+#define INPUT_BLOCK (1 << 20)				  /* bytes read from a pipe at a time */
+#define INPUT_TOKEN 32						  /* longest number kept whole across blocks */
+
+/* powers of ten up to 10^8, used by the SSE2 integer parser */
+#if defined(__SSE2__)
+static const unsigned long long POW10[] = {1, 10, 100, 1000, 10000, 100000,
+	1000000, 10000000, 100000000};
+#endif
+
+#define FILE_MAGIC "LIDX"					  /* on-disk index format */
+#define FILE_VERSION 2
+#define FILE_ENDIAN 0x01020304
+
+#define DIST_NONE (-1)						  /* synthetic key distributions */
+#define DIST_UNIFORM 0
+#define DIST_NORMAL 1
+#define DIST_LOGNORMAL 2
+#define DIST_ZIPF 3
+#define DIST_CLUSTER 4
+#define DIST_TIME 5
+#define DIST_ALL 6
+#define WORKLOAD_MIN 1000					  /* smallest generated dataset */
+#define WORKLOAD_ERR 64						  /* default target maximum prediction error */
+#define WORKLOAD_QUERIES 100000				  /* default hit and miss queries per size */
+#define WORKLOAD_CLUSTERS 64				  /* clusters of the clustered keys */
+#define WORKLOAD_DAYS 16					  /* rate cycles of the timestamps */
+#define WORKLOAD_TRIES 64					  /* random tries to draw a missing key */
+#define WORKLOAD_HEADER "Workload\n==========\n" /* workload header */
+#define TUNE_QUERIES 20000					  /* hit and miss queries timed per max_err */
+#define TUNE_ROUNDS 3						  /* timings of each max_err, the best is kept */
+#define PI 3.14159265358979323846			  /* M_PI is not in C17 */
+
+#define STATS_BINS 24						  /* power of two buckets of the histograms */
+#define STATS_HEADER "Statistics\n==========\n" /* statistics header */
+
+#define QUERY_EXACT 0						  /* stage 4 query kinds */
+#define QUERY_LOWER 1
+#define QUERY_UPPER 2
+#define QUERY_RANGE 3
+
+/* key types. every type defines the range of its keys and how they
+ * are read, printed, subtracted for the models and mapped onto
+ * unsigned integers in the same order for the radix sort:
+ *   default        32-bit ints
+ *   -DKEY_INT64    64-bit ints, such as timestamps and ids
+ *   -DKEY_DOUBLE   doubles, NaN is rejected on input
+ *   -DKEY_STRING   strings, indexed by their first KEY_WIDTH bytes
+ *                  packed into an integer with the first byte on top,
+ *                  so longer strings with the same prefix are equal */
+#if defined(KEY_INT64)
+typedef long long data_t;
+#define KEY_TYPE 1
+#define KEY_MIN LLONG_MIN
+#define KEY_MAX LLONG_MAX
+#elif defined(KEY_DOUBLE)
+typedef double data_t;
+#define KEY_TYPE 2
+#define KEY_MIN (-DBL_MAX)
+#define KEY_MAX DBL_MAX
+#elif defined(KEY_STRING)
+typedef unsigned long long data_t;
+#define KEY_TYPE 3
+#define KEY_MIN 0
+#define KEY_MAX ULLONG_MAX
+#define KEY_WIDTH ((int) sizeof(data_t))
+#else
+#define KEY_INT32
 typedef int data_t; 				  		  /* data type */
+#define KEY_TYPE 0
+#define KEY_MIN INT_MIN
+#define KEY_MAX INT_MAX
+#endif
+#define KEY_CHARS 32						  /* longest printed key */
+#define KEY_BUFFERS 4						  /* keys printed by one printf */
 
-/* custom structure to store data domains (task 3.3.4) */
+/* custom structure to store data domains (task 3.3.4),
+ * a and b may be fractional for the optimal segmentation. the model
+ * is f(key) = (key - origin) / b + a, or a when b is 0, so that wide
+ * keys are subtracted exactly before any rounding and the function is
+ * exact at origin. it is printed in the (key + a) / b form */
 struct Map {
-	int a;
-	int b;
+	double a;
+	double b;
 	data_t max;
+	data_t origin;
 };
 
 /* create a new type for the structure */
 typedef struct Map map_t; 
 
+/* growable heap-backed array of input data, so that the dataset
+ * size is no longer limited by the stack */
+typedef struct {
+	data_t *items;
+	int len;
+	int cap;
+} data_arr_t;
+
+/* growable heap-backed array of mapping functions */
+typedef struct {
+	map_t *items;
+	int len;
+	int cap;
+} map_arr_t;
+
+/* a (key, position) point used by the optimal segmentation, with the
+ * key measured from the first key of the segment */
+typedef struct {
+	long double x;
+	long long y;
+} point_t;
+
+/* growable heap-backed array of points, holds the convex hulls */
+typedef struct {
+	point_t *items;
+	int len;
+	int cap;
+} point_arr_t;
+
+/* state of the streaming optimal piecewise linear approximation,
+ * adapted from the convex hull algorithm used by the PGM-index
+ * (Ferragina and Vinciguerra, 2020): the upper and lower hulls of the
+ * points seen so far bound every line that is within max_err of all
+ * of them, and rect holds the two extreme feasible lines */
+typedef struct {
+	long long err;
+	point_arr_t upper;
+	point_arr_t lower;
+	int upper_start;
+	int lower_start;
+	int points; /* number of points in the current segment */
+	data_t first; /* first key of the current segment */
+	point_t rect[4];
+} pla_t;
+
+/* one level of the recursive model layer. the keys are the max
+ * elements of the functions in the level below, and each model
+ * predicts where a key goes among them. the root level has no models
+ * and is small enough to be scanned in one cache line */
+typedef struct {
+	data_t *keys;
+	int len;
+	map_arr_t models;
+	int *starts; /* index of the first key covered by each model */
+} level_t;
+
+/* growable heap-backed array of levels, from the bottom to the root */
+typedef struct {
+	level_t *items;
+	int len;
+	int cap;
+} level_arr_t;
+
+/* one model of the compact segment table, anchored on the max element
+ * of its segment: f(key) = base + (key - max) * slope. a model that
+ * does not fit keeps a NaN slope and the number of its mapping in base,
+ * and predicts with the mapping instead */
+typedef struct {
+	int base;    /* rounded position predicted for the max element */
+	float slope; /* positions per key, 0 for the constant functions */
+} cmodel_t;
+
+/* compact segment table. the max elements are kept apart from the
+ * models in Eytzinger order, the children of keys[k] being keys[2k]
+ * and keys[2k+1], so that Step 2 only reads keys and the next levels
+ * of a search share cache lines. the rounded models may predict a key
+ * further off than max_err, by at most slack positions */
+typedef struct {
+	data_t *keys;     /* from keys[1], aligned to a cache line */
+	cmodel_t *models; /* the model of the segment whose max is keys[k] */
+	int len;
+	int depth;        /* levels of the tree */
+	int last;         /* slot of the largest max element */
+	int slack;
+} compact_t;
+
+/* the learned index built by stage 3 */
+typedef struct {
+	data_t *dataset;
+	int n;
+	map_t *mappings;
+	int mps_len;
+	int max_err;
+	level_arr_t *levels; /* empty when Step 2 uses binary search */
+	compact_t *compact;  /* NULL unless the compact table is used */
+} index_t;
+
+/* one segment of the updatable index. it owns its keys and a model
+ * that predicts their positions within max_err, plus sorted buffers
+ * of the keys inserted and deleted since it was last trained */
+typedef struct {
+	data_t *keys;
+	int len;
+	map_t model;
+	data_arr_t inserts;
+	data_arr_t deletes; /* keys of the segment that no longer count */
+} dyn_seg_t;
+
+/* updatable learned index: segments are routed to by the smallest key
+ * they may hold, and retrained on their own once their buffers fill */
+typedef struct {
+	dyn_seg_t *segs;
+	data_t *firsts; /* smallest key routed to each segment */
+	int len;
+	int cap;
+	int max_err;
+	int seg; /* segmentation engine the segments are refit with */
+	int retrains;
+} dyn_index_t;
+
+/* header of the on-disk index, followed by the sorted dataset and
+ * the mapping table, each starting on a cache line. the key type and
+ * the sizes of the keys and mappings are stored so that a build with a
+ * different layout rejects the file instead of misreading it */
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint32_t endian;
+	uint32_t data_size;
+	uint32_t map_size;
+	int32_t max_err;
+	uint32_t key_type;
+	uint64_t n;
+	uint64_t mps_len;
+	uint64_t data_offset;
+	uint64_t map_offset;
+	uint64_t data_sum;
+	uint64_t map_sum;
+	uint64_t header_sum; /* of all the fields above */
+} file_header_t;
+
+/* work of one thread of the parallel sort. each thread first sorts
+ * its own run of the input, then merges one bucket of keys between
+ * two splitters out of every run */
+typedef struct {
+	data_t *items;
+	data_t *tmp;
+	int lo; /* run sorted in the first phase */
+	int hi;
+	int threads;
+	int *cuts; /* cuts[r * (threads + 1) + b] is where bucket b starts in run r */
+	int bucket;
+	int out;   /* where the bucket starts in the sorted output */
+} sort_task_t;
+
+/* a worker of the query pool */
+typedef struct {
+	struct Pool *pool;
+	int id;
+	pthread_t thread;
+} worker_t;
+
+/* pool of workers answering query batches against one index, which
+ * they only read. each batch is split into one contiguous share per
+ * worker, and every answer is written at the position of its query so
+ * that the order of the queries is kept */
+struct Pool {
+	index_t *index;
+	int threads; /* the calling thread answers the first share */
+	worker_t workers[MAX_THREADS];
+	pthread_mutex_t lock;
+	pthread_cond_t go;
+	pthread_cond_t done;
+	int round; /* number of batches handed out */
+	int busy;  /* workers still answering the current batch */
+	int stop;
+	data_t *keys; /* the current batch */
+	int count;
+	int *out;
+	int pipe;
+};
+
+/* create a new type for the structure */
+typedef struct Pool pool_t;
+
+/* counters of the exact-match lookups, kept per thread and added up
+ * when a thread is done. a probe is one key compared by a search */
+typedef struct {
+	long long lookups;
+	long long found;
+	long long step2; /* probes finding the mapping, over all lookups */
+	long long step3; /* probes within the error window */
+	long long probes[STATS_BINS]; /* lookups by probes */
+	long long errors[STATS_BINS]; /* found keys by |prediction - position| */
+	long long over;   /* found keys predicted further than max_err */
+	int traced;       /* probes printed by the stage 4 searches */
+	int last2;        /* Step 2 probes of the last find_mapping */
+	int group2[PIPE_GROUP]; /* Step 2 probes of a group of lookups */
+} stats_t;
+
+/* time spent building the index, reported with -T */
+typedef struct {
+	int sort;  /* sort engine used by stage 1 */
+	double read_time;
+	double sort_time;
+	double model_time; /* stages 2 and 3 */
+} timing_t;
+
+/* buffered standard input, mapped into memory when it is a regular
+ * file and read in large blocks otherwise */
+typedef struct {
+	int format;
+	char *buf;
+	char *next; /* first byte not parsed yet */
+	char *end;
+	int eof;	/* nothing left to read beyond end */
+	size_t size; /* of the mapping, 0 if buf is a read buffer */
+} reader_t;
+
+/* a file mapped into memory */
+typedef struct {
+	void *addr;
+	size_t size;
+} mapped_t;
+
+/* iterator over the keys of a range query, streams them straight
+ * out of the dataset once both ends have been found */
+typedef struct {
+	data_t *next;
+	data_t *end;
+} range_iter_t;
+
+/* command line options */
+typedef struct {
+	int n;	 /* number of input integers to index */
+	int seg; /* stage 3 segmentation engine */
+	int rmi; /* index the mappings with the recursive model layer */
+	int batch; /* answer the stage 4 queries with the batch lookups */
+	int pipe;  /* answer the stage 4 queries with the pipelined lookups */
+	int bench; /* number of benchmark queries, 0 for no benchmark */
+	int query; /* kind of the stage 4 queries */
+	int updates; /* number of benchmark inserts, 0 for no benchmark */
+	char *save; /* file to save the index to after stage 3 */
+	char *load; /* index file to open instead of running stages 1 to 3 */
+	int sort;  /* stage 1 sort engine */
+	int threads; /* threads of the parallel sort and the query pool */
+	int timing; /* report the sort and model building times */
+	int format; /* format of the input */
+	int workload; /* distribution of the generated keys, DIST_NONE to read them */
+	int err; /* target maximum prediction error of the generated workloads */
+	int stats; /* report the lookup statistics */
+	long long tune; /* memory cap of the tuned segment table, 0 to not tune */
+	int compact; /* use the compact segment table */
+} opts_t;
+
 /****************************************************************/
 
 /* function prototypes */
@@ -47,76 +451,561 @@ int search_mappings(map_t mappings[], int lo, int hi, data_t *key, int *locn);
 int search_key(data_t dataset[], int lo, int hi, data_t *key, int *locn);
 
 /* Stages */
-void stage_one(data_t dataset[]);
-void stage_two(data_t dataset[]);
-void stage_three(data_t dataset[], map_t mappings[], int *mps_len, int *max_err);
-void stage_four(data_t dataset[], map_t mappings[], int mps_len, int max_err);
+void stage_one(data_arr_t *dataset, int n, opts_t *opts, timing_t *timing);
+void stage_two(data_t dataset[], int n);
+void stage_three(data_t dataset[], int n, map_arr_t *mappings, int *max_err,
+	level_arr_t *levels, opts_t *opts);
+void stage_four(index_t *index);
 
 /* add your own function prototypes here */
-void compute_ab(data_t dataset[], int y0, int y1, int *a, int *b);
-float compute_f_key(data_t key, float a, float b);
-int compute_err(data_t dataset[], int index, int a, int b);
+void compute_ab(data_t dataset[], int y0, int y1, map_t *map);
+double compute_f_key(data_t key, map_t *map);
+long long compute_err(data_t dataset[], int index, map_t *map);
+int predict_pos(data_t key, map_t *map, int lo, int hi);
+double key_diff(data_t key, data_t origin);
+char *key_str(data_t key);
+data_t key_next(data_t key);
+data_t key_prev(data_t key);
+data_t key_between(data_t lo, data_t hi, unsigned long long r);
+uint64_t key_bits(data_t key);
 int max(int a, int b);
 int min(int a, int b);
+void parse_opts(int argc, char *argv[], opts_t *opts);
+int parse_query(char *name, int *query);
+int parse_sort(char *name, int *sort);
+void data_arr_init(data_arr_t *arr, int cap);
+void data_arr_push(data_arr_t *arr, data_t value);
+void data_arr_free(data_arr_t *arr);
+void map_arr_init(map_arr_t *arr, int cap);
+void map_arr_push(map_arr_t *arr, map_t value);
+void map_arr_free(map_arr_t *arr);
+void point_arr_push(point_arr_t *arr, point_t value);
+void build_greedy(data_t dataset[], int n, int max_err, map_arr_t *mappings);
+void build_cone(data_t dataset[], int n, int max_err, map_arr_t *mappings);
+int search_depth(int mps_len);
+void pla_init(pla_t *pla, long long err);
+void pla_free(pla_t *pla);
+int pla_add(pla_t *pla, data_t key, long long y);
+void pla_model(pla_t *pla, double *slope, double *intercept);
+map_t pla_to_map(pla_t *pla, data_t max_elem);
+int slope_cmp(point_t s1, point_t s2);
+point_t vec(point_t p1, point_t p2);
+long double cross(point_t o, point_t a, point_t b);
+void level_arr_push(level_arr_t *arr, level_t value);
+void build_levels(map_t mappings[], int mps_len, level_arr_t *levels);
+void free_levels(level_arr_t *levels);
+int search_levels(level_arr_t *levels, data_t *key, int *locn);
+int search_level(data_t keys[], int lo, int hi, data_t *key, int *locn);
+
+/* quiet lookups used by the batch mode and the benchmark */
+void stage_four_batch(index_t *index, int pipe, int threads);
+void bench_lookups(index_t *index, int count, int threads);
+int lookup_scalar(index_t *index, data_t key);
+void lookup_batch(index_t *index, data_t keys[], int count, int out[]);
+void lookup_pipelined(index_t *index, data_t keys[], int count, int out[]);
+void search_windows(index_t *index, data_t keys[], int pos[], int count, int err, int out[]);
+void prefetch_window(data_t keys[], int lo, int hi);
+int find_mapping(index_t *index, data_t key);
+void find_mappings(index_t *index, data_t keys[], int count, int maps[]);
+void predict_positions(index_t *index, data_t keys[], int maps[], int count, int pos[]);
+int search_window(index_t *index, data_t key, int pos);
+int lower_bound(data_t keys[], int lo, int hi, data_t key);
+int count_less(data_t keys[], int len, data_t key);
+double now_sec(void);
+unsigned long long next_rand(unsigned long long *state);
+
+/* compact segment table */
+void build_compact(index_t *index, compact_t *compact);
+int fill_compact(index_t *index, compact_t *compact, int i, int k, int slots[]);
+int compact_predict(index_t *index, int k, data_t key);
+void lookup_compact(index_t *index, data_t keys[], int count, int out[]);
+long long compact_bytes(compact_t *compact);
+void free_compact(compact_t *compact);
+
+/* lower-bound, upper-bound and range queries */
+void stage_four_bounds(index_t *index, int query);
+int lookup_lower_bound(index_t *index, data_t key);
+int lookup_upper_bound(index_t *index, data_t key);
+int range_count(index_t *index, data_t lo, data_t hi);
+range_iter_t range_iter(index_t *index, data_t lo, data_t hi);
+int range_next(range_iter_t *it, data_t *key);
+
+/* updatable index */
+void dyn_build(dyn_index_t *dyn, index_t *index, int seg);
+void dyn_free(dyn_index_t *dyn);
+int dyn_route(dyn_index_t *dyn, data_t key);
+int dyn_find(dyn_index_t *dyn, data_t key);
+void dyn_insert(dyn_index_t *dyn, data_t key);
+int dyn_delete(dyn_index_t *dyn, data_t key);
+void dyn_retrain(dyn_index_t *dyn, int s);
+void dyn_fit(dyn_index_t *dyn, data_t keys[], int n, map_arr_t *models);
+void dyn_merge(dyn_seg_t *seg, data_arr_t *out);
+int dyn_base_find(dyn_seg_t *seg, int max_err, data_t key);
+int dyn_base_count(dyn_seg_t *seg, data_t key);
+int buffer_count(data_arr_t *buf, data_t key);
+void buffer_insert(data_arr_t *buf, data_t key);
+int buffer_remove(data_arr_t *buf, data_t key);
+void bench_updates(index_t *index, int count, opts_t *opts);
+int cmp_data(const void *x1, const void *x2);
+
+/* on-disk index */
+void save_index(char *path, index_t *index);
+void load_index(char *path, index_t *index, mapped_t *file);
+void unmap_index(mapped_t *file);
+uint64_t checksum(const void *buf, size_t len);
+uint64_t align_up(uint64_t offset);
+
+/* bulk input */
+void open_input(int format);
+void close_input(void);
+int read_key(data_t *key);
+int read_int(int *value);
+int read_bytes(unsigned char *out, int bytes);
+void skip_space(void);
+int fill_input(void);
+int parse_int(long long *value);
+unsigned long long digits_value(uint64_t word, int len);
+
+/* sort engines for stage 1 */
+int sort_data(data_t items[], int n, int engine, int threads);
+int is_sorted(data_t items[], int n);
+void radix_sort(data_t items[], int n, data_t tmp[]);
+void parallel_sort(data_t items[], int n, int threads);
+void *sort_run(void *arg);
+void *merge_bucket(void *arg);
+void run_threads(void *(*fn)(void*), sort_task_t tasks[], int threads);
+
+/* concurrent query serving */
+void pool_start(pool_t *pool, index_t *index, int threads);
+void pool_run(pool_t *pool, data_t keys[], int count, int out[], int pipe);
+void pool_stop(pool_t *pool);
+void *pool_worker(void *arg);
+void pool_share(pool_t *pool, int id);
+
+/* synthetic workloads */
+int parse_dist(char *name, int *dist);
+void run_workloads(opts_t *opts);
+void run_workload(int dist, data_t keys[], int n, opts_t *opts);
+void generate_keys(int dist, data_t keys[], int n, unsigned long long seed);
+double next_unit(unsigned long long *state);
+double next_normal(unsigned long long *state);
+data_t key_from_unit(double x);
+int draw_queries(data_t dataset[], int n, data_t hits[], data_t misses[], int count);
+void time_queries(index_t *index, int method, data_t keys[], int count, double lat[]);
+int workload_lookup(index_t *index, int method, data_t key);
+int find_key(data_t dataset[], int n, data_t key);
+int lower_bound_std(data_t keys[], int n, data_t key);
+long long index_bytes(index_t *index);
+long long now_ns(void);
+int cmp_double(const void *x1, const void *x2);
+
+/* max_err auto-tuning */
+int tune_max_err(data_t dataset[], int n, opts_t *opts);
+double time_lookups(index_t *index, data_t keys[], int count, int *out, opts_t *opts);
+
+/* lookup statistics */
+void trace_probe(data_t key);
+int search_probes(int len, int scan);
+void stats_lookup(int p2, int p3, int pred, int pos, int max_err);
+void stats_merge(void);
+void stats_dump(index_t *index);
+int stats_bin(long long value);
+void print_bins(char *name, long long bins[]);
+
+/* standard input, shared by all the stages */
+static reader_t input;
+
+#if defined(STATS)
+/* counters of this thread, and of the threads that are done */
+static _Thread_local stats_t stats;
+static stats_t stats_total;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
 /****************************************************************/
 
 /* main function controls all the action */
 int main(int argc, char *argv[]) {
-	/* to hold all input data */
-	data_t dataset[DATASET_SIZE];
+	opts_t opts;
+	parse_opts(argc, argv, &opts);
+
+	/* benchmark generated keys instead of indexing the input */
+	if (opts.workload != DIST_NONE) {
+		run_workloads(&opts);
+		if (opts.stats) {
+			stats_dump(NULL);
+		}
+		return 0;
+	}
+	open_input(opts.format);
+
+	/* to hold all input data, allocated on the heap so that
+	 * large datasets do not overflow the stack */
+	data_arr_t dataset = {NULL, 0, 0};
 	int max_err;
 
 	/* to hold the mapping functions */
-	map_t mappings[DATASET_SIZE];
-	int mps_len = 0; /* length of mappings array */
+	map_arr_t mappings = {NULL, 0, 0};
 
-	/* stage 1: read and sort the input */
-	stage_one(dataset); 
-	
-	/* stage 2: compute the first mapping function */
-	stage_two(dataset);
-	
-	/* stage 3: compute more mapping functions */ 
-	stage_three(dataset, mappings, &mps_len, &max_err);
+	/* to hold the recursive model layer over the mappings */
+	level_arr_t levels = {NULL, 0, 0};
+
+	/* to hold the compact segment table */
+	compact_t compact = {NULL, NULL, 0, 0, 0, 0};
+
+	index_t index = {NULL, 0, NULL, 0, 0, &levels, NULL};
+	mapped_t file = {NULL, 0};
+
+	if (opts.load != NULL) {
+		/* stages 1 to 3 were done by an earlier run */
+		load_index(opts.load, &index, &file);
+		printf("Loaded %s: %d keys, %d functions, target maximum prediction "
+			"error: %d\n\n", opts.load, index.n, index.mps_len, index.max_err);
+		if (opts.rmi) {
+			build_levels(index.mappings, index.mps_len, &levels);
+		}
+	} else {
+		data_arr_init(&dataset, opts.n);
+		map_arr_init(&mappings, INIT_CAPACITY);
+
+		/* stage 1: read and sort the input */
+		timing_t timing;
+		stage_one(&dataset, opts.n, &opts, &timing); 
+		
+		/* stage 2: compute the first mapping function */
+		double start = now_sec();
+		stage_two(dataset.items, dataset.len);
+		
+		/* stage 3: compute more mapping functions */ 
+		stage_three(dataset.items, dataset.len, &mappings, &max_err, &levels, &opts);
+		timing.model_time = now_sec() - start;
+
+		if (opts.timing) {
+			char *names[] = {"auto", "quick", "radix", "parallel", "presorted"};
+			printf(TIMING_HEADER);
+			printf("Read: %.3f s\n", timing.read_time);
+			printf("Sort (%s, %d thread%s): %.3f s\n", names[timing.sort],
+				timing.sort == SORT_PARALLEL ? opts.threads : 1,
+				timing.sort == SORT_PARALLEL && opts.threads > 1 ? "s" : "",
+				timing.sort_time);
+			printf("Model building: %.3f s\n\n", timing.model_time);
+		}
+
+		index.dataset = dataset.items;
+		index.n = dataset.len;
+		index.mappings = mappings.items;
+		index.mps_len = mappings.len;
+		index.max_err = max_err;
+		if (opts.save != NULL) {
+			save_index(opts.save, &index);
+		}
+	}
+
+	/* pack the mappings for the batch and pipelined lookups */
+	if (opts.compact) {
+		build_compact(&index, &compact);
+		printf("Compact table: %d functions, %lld bytes (mappings: %lld), "
+			"extra error: %d\n\n", compact.len, compact_bytes(&compact),
+			(long long) sizeof(map_t) * index.mps_len, compact.slack);
+	}
 	
 	/* stage 4: perform exact-match queries */
-	stage_four(dataset, mappings, mps_len, max_err);
+	if (opts.query != QUERY_EXACT) {
+		stage_four_bounds(&index, opts.query);
+	} else if (opts.batch || opts.pipe) {
+		stage_four_batch(&index, opts.pipe, opts.threads);
+	} else {
+		stage_four(&index);
+	}
+
+	/* compare the scalar and batch lookups on random queries */
+	if (opts.bench > 0) {
+		bench_lookups(&index, opts.bench, opts.threads);
+	}
+
+	/* compare local retraining against a full rebuild */
+	if (opts.updates > 0) {
+		bench_updates(&index, opts.updates, &opts);
+	}
+
+	/* how the lookups went */
+	if (opts.stats) {
+		stats_dump(&index);
+	}
 	
 	/* all done; take some rest */
+	data_arr_free(&dataset);
+	map_arr_free(&mappings);
+	free_levels(&levels);
+	free_compact(&compact);
+	unmap_index(&file);
+	close_input();
+	return 0;
+}
+
+/* parse the name of a sort engine, returns 0 if it is unknown */
+int parse_sort(char *name, int *sort) {
+	char *names[] = {"auto", "quick", "radix", "parallel"};
+	for (int i = 0; i < (int) (sizeof(names) / sizeof(*names)); i++) {
+		if (strcmp(name, names[i]) == 0) {
+			*sort = i;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/****************************************************************/
+
+/* read command line options:
+ *   -n <count>         number of input integers (default DATASET_SIZE)
+ *   -s greedy|cone     stage 3 segmentation engine (default greedy)
+ *   -r                 find the mapping in Step 2 with the recursive
+ *                      model layer instead of binary search
+ *   -b                 answer the stage 4 queries as one batch
+ *   -p                 answer the stage 4 queries with the pipelined,
+ *                      prefetching lookups
+ *   -B <count>         benchmark scalar, batch and pipelined lookups
+ *   -q exact|lower|upper|range
+ *                      kind of the stage 4 queries (default exact),
+ *                      range queries are given as pairs of keys
+ *   -U <count>         benchmark inserts and deletes on the updatable
+ *                      index against a full rebuild
+ *   -o <file>          save the index to file after stage 3
+ *   -i <file>          open a saved index instead of running stages
+ *                      1 to 3, the input then only holds the queries
+ *   -S auto|quick|radix|parallel
+ *                      stage 1 sort engine (default auto, see sort_data)
+ *   -t <count>         threads of the parallel sort and of the batch
+ *                      and pipelined lookups (default all cores)
+ *   -T                 report the sort and model building times
+ *   -f text|binary     input format (default text), binary input is a
+ *                      stream of little-endian keys in the same order
+ *                      as the text input, with the maximum error as a
+ *                      32-bit int and string keys as KEY_WIDTH bytes
+ *   -W uniform|normal|lognormal|zipf|cluster|time|all
+ *                      benchmark generated keys instead of reading the
+ *                      input, with datasets of 1000, 10000, ... up to
+ *                      -n keys and -B hit and miss queries each
+ *   -e <err>           target maximum prediction error of the generated
+ *                      workloads (default WORKLOAD_ERR)
+ *   -A <bytes>         replace the target maximum prediction error by
+ *                      the one with the fastest lookups whose mappings
+ *                      and model levels fit in bytes
+ *   -c                 answer the batch and pipelined lookups with the
+ *                      compact segment table instead of the mappings
+ *   -z                 report the probes and prediction errors of the
+ *                      exact-match lookups and the segment sizes, needs
+ *                      a build with -DSTATS
+ */
+void parse_opts(int argc, char *argv[], opts_t *opts) {
+	opts->n = DATASET_SIZE;
+	opts->seg = SEG_GREEDY;
+	opts->rmi = 0;
+	opts->batch = 0;
+	opts->pipe = 0;
+	opts->query = QUERY_EXACT;
+	opts->updates = 0;
+	opts->save = NULL;
+	opts->load = NULL;
+	opts->sort = SORT_AUTO;
+	opts->threads = sysconf(_SC_NPROCESSORS_ONLN);
+	opts->timing = 0;
+	opts->format = INPUT_TEXT;
+	opts->bench = 0;
+	opts->workload = DIST_NONE;
+	opts->err = WORKLOAD_ERR;
+	opts->stats = 0;
+	opts->tune = 0;
+	opts->compact = 0;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+			opts->n = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc
+				&& strcmp(argv[i + 1], "greedy") == 0) {
+			opts->seg = SEG_GREEDY;
+			i++;
+		} else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc
+				&& strcmp(argv[i + 1], "cone") == 0) {
+			opts->seg = SEG_CONE;
+			i++;
+		} else if (strcmp(argv[i], "-r") == 0) {
+			opts->rmi = 1;
+		} else if (strcmp(argv[i], "-b") == 0) {
+			opts->batch = 1;
+		} else if (strcmp(argv[i], "-p") == 0) {
+			opts->pipe = 1;
+		} else if (strcmp(argv[i], "-B") == 0 && i + 1 < argc) {
+			opts->bench = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc
+				&& parse_query(argv[i + 1], &opts->query)) {
+			i++;
+		} else if (strcmp(argv[i], "-U") == 0 && i + 1 < argc) {
+			opts->updates = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+			opts->save = argv[++i];
+		} else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+			opts->load = argv[++i];
+		} else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc
+				&& parse_sort(argv[i + 1], &opts->sort)) {
+			i++;
+		} else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+			opts->threads = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-T") == 0) {
+			opts->timing = 1;
+		} else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc
+				&& strcmp(argv[i + 1], "text") == 0) {
+			opts->format = INPUT_TEXT;
+			i++;
+		} else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc
+				&& strcmp(argv[i + 1], "binary") == 0) {
+			opts->format = INPUT_BINARY;
+			i++;
+		} else if (strcmp(argv[i], "-W") == 0 && i + 1 < argc
+				&& parse_dist(argv[i + 1], &opts->workload)) {
+			i++;
+		} else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+			opts->err = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-A") == 0 && i + 1 < argc) {
+			opts->tune = atoll(argv[++i]);
+		} else if (strcmp(argv[i], "-c") == 0) {
+			opts->compact = 1;
+		} else if (strcmp(argv[i], "-z") == 0) {
+#if !defined(STATS)
+			fprintf(stderr, "-z needs a build with -DSTATS\n");
+			exit(EXIT_FAILURE);
+#endif
+			opts->stats = 1;
+		} else {
+			fprintf(stderr, "usage: %s [-n count] [-s greedy|cone] [-r] [-b] [-p] "
+				"[-B count] [-q exact|lower|upper|range] [-U count] [-o file] [-i file] "
+				"[-S auto|quick|radix|parallel] [-t count] [-T] [-f text|binary] "
+				"[-W uniform|normal|lognormal|zipf|cluster|time|all] [-e err] [-A bytes] [-c] [-z]\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (opts->n < DATASET_MIN) {
+		fprintf(stderr, "need at least %d input integers\n", DATASET_MIN);
+		exit(EXIT_FAILURE);
+	}
+	if (opts->err < 0) {
+		fprintf(stderr, "the target maximum prediction error must not be negative\n");
+		exit(EXIT_FAILURE);
+	}
+	opts->threads = max(1, min(opts->threads, MAX_THREADS));
+}
+
+/* read the kind of the stage 4 queries, returns 0 if unknown */
+int parse_query(char *name, int *query) {
+	char *names[] = {"exact", "lower", "upper", "range"};
+	for (int i = 0; i < (int) (sizeof(names) / sizeof(*names)); i++) {
+		if (strcmp(name, names[i]) == 0) {
+			*query = i;
+			return 1;
+		}
+	}
 	return 0;
 }
 
+/* create an empty data array with space for cap items */
+void data_arr_init(data_arr_t *arr, int cap) {
+	arr->cap = max(cap, 1);
+	arr->len = 0;
+	arr->items = (data_t*)malloc(sizeof(*arr->items) * arr->cap);
+	assert(arr->items!=NULL);
+}
+
+/* append a value, doubling the capacity when the array is full */
+void data_arr_push(data_arr_t *arr, data_t value) {
+	if (arr->len == arr->cap) {
+		arr->cap *= 2;
+		arr->items = (data_t*)realloc(arr->items, sizeof(*arr->items) * arr->cap);
+		assert(arr->items!=NULL);
+	}
+	arr->items[arr->len++] = value;
+}
+
+/* free the memory held by a data array */
+void data_arr_free(data_arr_t *arr) {
+	free(arr->items);
+	arr->items = NULL;
+	arr->len = arr->cap = 0;
+}
+
+/* create an empty mapping array with space for cap items */
+void map_arr_init(map_arr_t *arr, int cap) {
+	arr->cap = max(cap, 1);
+	arr->len = 0;
+	arr->items = (map_t*)malloc(sizeof(*arr->items) * arr->cap);
+	assert(arr->items!=NULL);
+}
+
+/* append a mapping function, doubling the capacity when the array is full */
+void map_arr_push(map_arr_t *arr, map_t value) {
+	if (arr->len == arr->cap) {
+		arr->cap *= 2;
+		arr->items = (map_t*)realloc(arr->items, sizeof(*arr->items) * arr->cap);
+		assert(arr->items!=NULL);
+	}
+	arr->items[arr->len++] = value;
+}
+
+/* free the memory held by a mapping array */
+void map_arr_free(map_arr_t *arr) {
+	free(arr->items);
+	arr->items = NULL;
+	arr->len = arr->cap = 0;
+}
+
+/* append a point, doubling the capacity when the array is full */
+void point_arr_push(point_arr_t *arr, point_t value) {
+	if (arr->len == arr->cap) {
+		arr->cap = max(arr->cap * 2, INIT_CAPACITY);
+		arr->items = (point_t*)realloc(arr->items, sizeof(*arr->items) * arr->cap);
+		assert(arr->items!=NULL);
+	}
+	arr->items[arr->len++] = value;
+}
+
 /****************************************************************/
 
 /* compute a and b from two elements in the dataset array */
-void compute_ab(data_t dataset[], int y0, int y1, int *a, int *b) {
+void compute_ab(data_t dataset[], int y0, int y1, map_t *map) {
 	/* y0, y1 are the index positions */
 	/* x0, x1 are the element values */
 	data_t x0 = dataset[y0];
 	data_t x1 = dataset[y1];
-	if (x0 == x1) {
-		*a = y0;
-		*b = 0;
-	} else {
-		*a = y0 * x1 - y1 * x0;
-		*b = x1 - x0;
-	}
+	map->origin = x0;
+	map->a = y0;
+	map->b = x0 == x1
+		? 0
+		: key_diff(x1, x0) / (y1 - y0);
 }
 
 /* compute f(key) value */
-float compute_f_key(data_t key, float a, float b) {
-	return b == 0 
-		? a
-		: ((float) key + a) / b;
+double compute_f_key(data_t key, map_t *map) {
+	return map->b == 0 
+		? map->a
+		: key_diff(key, map->origin) / map->b + map->a;
 }
 
-/* compute the prediction error */
-int compute_err(data_t dataset[], int index, int a, int b) {
-	int f_key = b == 0 
-		? a 
-		: ceil(compute_f_key(dataset[index], a, b));
-	return abs(f_key - index);
+/* compute the prediction error. it is taken in double and capped at
+ * ERR_CAP, as the prediction of a far key may not fit in an int */
+long long compute_err(data_t dataset[], int index, map_t *map) {
+	double f_key = map->b == 0 
+		? map->a 
+		: ceil(compute_f_key(dataset[index], map));
+	double err = fabs(f_key - index);
+	return err < ERR_CAP ? (long long) err : ERR_CAP;
+}
+
+/* ceil(f(key)) clamped to [lo, hi] before it is converted, so that a
+ * prediction far outside the int range, or NaN, gives lo or hi */
+int predict_pos(data_t key, map_t *map, int lo, int hi) {
+	double f = ceil(compute_f_key(key, map));
+	return f > lo ? (f < hi ? (int) f : hi) : lo;
 }
 
 /* return the bigger of two integers */
@@ -133,44 +1022,134 @@ int min(int a, int b) {
 		: b;
 }
 
+/* key - origin as a double, subtracted in a type wide enough that it
+ * cannot overflow, so that models anchored at origin stay precise */
+double key_diff(data_t key, data_t origin) {
+#if defined(KEY_DOUBLE)
+	return key - origin;
+#elif defined(KEY_INT32)
+	return (long long) key - origin;
+#else
+	return key >= origin
+		? (double) ((unsigned long long) key - (unsigned long long) origin)
+		: -(double) ((unsigned long long) origin - (unsigned long long) key);
+#endif
+}
+
+/* format a key for printing, the result stays valid for the next
+ * KEY_BUFFERS - 1 calls */
+char *key_str(data_t key) {
+	static char bufs[KEY_BUFFERS][KEY_CHARS];
+	static int next = 0;
+	char *buf = bufs[next];
+	next = (next + 1) % KEY_BUFFERS;
+
+#if defined(KEY_INT64)
+	snprintf(buf, KEY_CHARS, "%lld", key);
+#elif defined(KEY_DOUBLE)
+	snprintf(buf, KEY_CHARS, "%.17g", key);
+#elif defined(KEY_STRING)
+	int len = 0;
+	for (int i = KEY_WIDTH - 1; i >= 0 && (key >> (8 * i) & 0xFF) != 0; i--) {
+		buf[len++] = key >> (8 * i) & 0xFF;
+	}
+	buf[len] = '\0';
+#else
+	snprintf(buf, KEY_CHARS, "%d", key);
+#endif
+	return buf;
+}
+
+/* the smallest key bigger than key, which must not be KEY_MAX */
+data_t key_next(data_t key) {
+#if defined(KEY_DOUBLE)
+	return nextafter(key, INFINITY);
+#else
+	return key + 1;
+#endif
+}
+
+/* the biggest key smaller than key, which must not be KEY_MIN */
+data_t key_prev(data_t key) {
+#if defined(KEY_DOUBLE)
+	return nextafter(key, -INFINITY);
+#else
+	return key - 1;
+#endif
+}
+
+/* a key in [lo, hi] picked by the random number r */
+data_t key_between(data_t lo, data_t hi, unsigned long long r) {
+#if defined(KEY_DOUBLE)
+	return fmin(hi, lo + (hi - lo) * ((r >> 11) * 0x1.0p-53));
+#else
+	unsigned long long range = (unsigned long long) hi - (unsigned long long) lo + 1;
+	return range == 0
+		? (data_t) r
+		: (data_t) ((unsigned long long) lo + r % range);
+#endif
+}
+
+/* map a key onto an unsigned integer, keeping the order of the keys */
+uint64_t key_bits(data_t key) {
+#if defined(KEY_DOUBLE)
+	uint64_t bits;
+	memcpy(&bits, &key, sizeof(bits));
+	return bits >> 63 ? ~bits : bits | (1ULL << 63);
+#elif defined(KEY_STRING)
+	return key;
+#else
+	return (uint64_t) key - (uint64_t) KEY_MIN;
+#endif
+}
+
 /* stage 1: read and sort the input */
-void stage_one(data_t dataset[]) {
+void stage_one(data_arr_t *dataset, int n, opts_t *opts, timing_t *timing) {
 	/* print stage header */
 	print_stage_header(STAGE_NUM_ONE);
 
 	/* read input numbers */
-	int num = 0;
-	for (int i = 0; i < DATASET_SIZE; i++) {
-		scanf("%d", &num);
-		dataset[i] = num;
+	double start = now_sec();
+	data_t num = 0;
+	for (int i = 0; i < n; i++) {
+		if (read_key(&num) != 1) {
+			fprintf(stderr, "expected %d input integers, got %d\n", n, i);
+			exit(EXIT_FAILURE);
+		}
+		data_arr_push(dataset, num);
 	}
 
+	timing->read_time = now_sec() - start;
+
 	/* sort the dataset */
-	quick_sort(dataset, DATASET_SIZE);
+	start = now_sec();
+	timing->sort = sort_data(dataset->items, dataset->len, opts->sort, opts->threads);
+	timing->sort_time = now_sec() - start;
 	
 	/* print sorted items */
-	printf("First %d numbers:", DATA_OUTPUT_SIZE);
-	for (int i = 0; i < DATA_OUTPUT_SIZE; i++) {
-		printf(" %d", dataset[i]);
+	int out_size = min(DATA_OUTPUT_SIZE, dataset->len);
+	printf("First %d numbers:", out_size);
+	for (int i = 0; i < out_size; i++) {
+		printf(" %s", key_str(dataset->items[i]));
 	}
 
 	printf("\n\n");
 }
 
 /* stage 2: compute the first mapping function */
-void stage_two(data_t dataset[]) {
+void stage_two(data_t dataset[], int n) {
 	/* add code for stage 2 */
 	/* print stage header */
 	print_stage_header(STAGE_NUM_TWO);
 
-	int a, b;
-	compute_ab(dataset, 0, 1, &a, &b);
+	map_t map;
+	compute_ab(dataset, 0, 1, &map);
 
 	/* compute the maximum prediction error */
-	int biggest_err = 0;
+	long long biggest_err = 0;
 	int biggest_index = 0; /* index position of the corresponding dataset element */
-	for (int i = 0; i < DATASET_SIZE; i++) {
-		int err = compute_err(dataset, i, a, b);
+	for (int i = 0; i < n; i++) {
+		long long err = compute_err(dataset, i, &map);
 		if (err > biggest_err) {
 			biggest_err = err;
 			biggest_index = i;
@@ -178,75 +1157,464 @@ void stage_two(data_t dataset[]) {
 	}
 
 	/* print the maximum prediction error and the corresponding dataset element */
-	printf("Maximum prediction error: %d\n", biggest_err);
-	printf("For key: %d\n", dataset[biggest_index]);
+	printf("Maximum prediction error: %lld\n", biggest_err);
+	printf("For key: %s\n", key_str(dataset[biggest_index]));
 	printf("At position: %d\n", biggest_index);
 	printf("\n");
 }
 
 /* stage 3: compute more mapping functions */ 
-void stage_three(data_t dataset[], map_t mappings[], int *mps_len, int *max_err) {
+void stage_three(data_t dataset[], int n, map_arr_t *mappings, int *max_err,
+		level_arr_t *levels, opts_t *opts) {
+	int seg = opts->seg;
+
 	/* print stage header */
 	print_stage_header(STAGE_NUM_THREE);
 
 	/* read input */
-	scanf("%d", max_err);
+	if (read_int(max_err) != 1) {
+		fprintf(stderr, "expected the target maximum prediction error\n");
+		exit(EXIT_FAILURE);
+	}
+	if (opts->tune > 0) {
+		*max_err = tune_max_err(dataset, n, opts);
+	}
 	printf("Target maximum prediction error: %d\n", *max_err);
 
-	int a, b;
-	compute_ab(dataset, 0, 1, &a, &b);
+	if (seg == SEG_CONE) {
+		build_cone(dataset, n, *max_err, mappings);
+	} else {
+		build_greedy(dataset, n, *max_err, mappings);
+	}
+
+	/* print the maximum element covered by each function */
+	for (int i = 0; i < mappings->len; i++) {
+		map_t *map = &mappings->items[i];
+		long double a = map->b == 0
+			? map->a
+			: (long double) map->a * map->b - key_diff(map->origin, 0);
+		if (seg == SEG_CONE) {
+			printf("Function %2d: a = %8.2Lf, b = %6.3f, max element = %3s\n",
+				i, a, map->b, key_str(map->max));
+		} else {
+			printf("Function %2d: a = %4.0Lf, b = %3.0f, max element = %3s\n",
+				i, a, map->b, key_str(map->max));
+		}
+	}
 
-	for (int i = 2; i < DATASET_SIZE; i++) {
-		int err = compute_err(dataset, i, a, b);
-		/* instead of using an auxiliary variable:
-		 * set the default value to -1 to represent negative state
-		 * since all inputs are positive integers */
-		data_t max_elem = -1;
+	/* compare against the greedy builder */
+	if (seg == SEG_CONE) {
+		map_arr_t greedy;
+		map_arr_init(&greedy, INIT_CAPACITY);
+		build_greedy(dataset, n, *max_err, &greedy);
+		printf("Greedy functions: %d, optimal functions: %d (%d fewer)\n",
+			greedy.len, mappings->len, greedy.len - mappings->len);
+		printf("Step 2 search depth: %d (greedy: %d)\n",
+			search_depth(mappings->len), search_depth(greedy.len));
+		map_arr_free(&greedy);
+	}
 
-		if (err > *max_err) {
-			max_elem = dataset[i - 1];
-		} else if (i == DATASET_SIZE - 1) { /* last element is always covered */
-			max_elem = dataset[i];
+	/* index the mappings themselves, level by level */
+	if (opts->rmi) {
+		build_levels(mappings->items, mappings->len, levels);
+		for (int i = 0; i < levels->len; i++) {
+			printf("Model level %d: %d keys, %d functions\n",
+				i, levels->items[i].len, levels->items[i].models.len);
 		}
+	}
+
+	printf("\n");
+}
 
-		/* print and store the maximum element covered */
-		if (max_elem >= 0) {
-			printf("Function %2d: a = %4d, b = %3d, max element = %3d\n", *mps_len, a, b, max_elem);
-			mappings[*mps_len].a = a;
-			mappings[*mps_len].b = b;
-			mappings[*mps_len].max = max_elem;
-			(*mps_len)++;
+/* greedily build the mapping functions, each anchored on two adjacent
+ * elements and cut as soon as one element exceeds max_err */
+void build_greedy(data_t dataset[], int n, int max_err, map_arr_t *mappings) {
+	map_t map;
+	compute_ab(dataset, 0, 1, &map);
+
+	for (int i = 2; i < n; i++) {
+		long long err = compute_err(dataset, i, &map);
+
+		/* store the maximum element covered */
+		if (err > max_err) {
+			map.max = dataset[i - 1];
+			map_arr_push(mappings, map);
+		} else if (i == n - 1) { /* last element is always covered */
+			map.max = dataset[i];
+			map_arr_push(mappings, map);
 		}
 
 		/* re-calculate a and b (after the values have been stored) */
-		if (err > *max_err) {
-			if (i == DATASET_SIZE - 2) {
+		if (err > max_err) {
+			if (i >= n - 1) {
 				/* special case when there is only 1 element left to process */
-				a = DATASET_SIZE - 1;
-				b = 0;
+				map.a = n - 1;
+				map.b = 0;
 			} else {
-				compute_ab(dataset, i, i + 1, &a, &b);
+				compute_ab(dataset, i, i + 1, &map);
 			}
 		}
 	}
 
-	printf("\n");
+	/* the last element may have been cut off on its own */
+	if (mappings->items[mappings->len - 1].max != dataset[n - 1]) {
+		map.max = dataset[n - 1];
+		map_arr_push(mappings, map);
+	}
+}
+
+/* build the fewest mapping functions that keep every key within
+ * max_err of its position, in one pass over the dataset.
+ *
+ * only the first position of each distinct key is modelled, which is
+ * the position the exact-match and lower-bound searches need. since
+ * the lookups take ceil(f(key)), any f(key) in (pos - max_err - 1,
+ * pos + max_err] is good enough. the fit works on positions scaled by
+ * PLA_SCALE and centred in that range, leaving 1 / PLA_SCALE of a slot
+ * on both ends as slack for floating point rounding */
+void build_cone(data_t dataset[], int n, int max_err, map_arr_t *mappings) {
+	long long err = PLA_SCALE * (long long) max_err + PLA_SCALE / 2 - 1;
+	pla_t pla;
+	pla_init(&pla, err);
+
+	for (int i = 0; i < n; i++) {
+		if (i > 0 && dataset[i] == dataset[i - 1]) {
+			continue;
+		}
+		long long y = PLA_SCALE * (long long) i - PLA_SCALE / 2;
+		if (!pla_add(&pla, dataset[i], y)) {
+			/* the key does not fit, close the function before it */
+			map_arr_push(mappings, pla_to_map(&pla, dataset[i - 1]));
+			pla_add(&pla, dataset[i], y);
+		}
+	}
+
+	map_arr_push(mappings, pla_to_map(&pla, dataset[n - 1]));
+	pla_free(&pla);
+}
+
+/* convert the current segment, fitted on scaled positions, to the
+ * f(key) = (key - origin) / b + a form used by the lookups */
+map_t pla_to_map(pla_t *pla, data_t max_elem) {
+	double slope, intercept;
+	pla_model(pla, &slope, &intercept);
+
+	map_t map = {intercept / PLA_SCALE, 0, max_elem, pla->first};
+	if (slope != 0) {
+		map.b = PLA_SCALE / slope;
+	}
+	return map;
+}
+
+/* number of comparisons a binary search over the mappings takes */
+int search_depth(int mps_len) {
+	int depth = 0;
+	while (mps_len > 0) {
+		mps_len /= 2;
+		depth++;
+	}
+	return depth;
+}
+
+/****************************************************************/
+/* optimal piecewise linear approximation, adapted from
+   https://github.com/gvinciguerra/PGM-index (piecewise_linear_model.hpp)
+*/
+
+/* compare the slopes of two vectors whose x components have the same
+ * sign, returns negative, zero or positive */
+int slope_cmp(point_t s1, point_t s2) {
+	long double lhs = (long double) s1.y * s2.x;
+	long double rhs = (long double) s1.x * s2.y;
+	return (lhs > rhs) - (lhs < rhs);
+}
+
+/* the vector from p2 to p1 */
+point_t vec(point_t p1, point_t p2) {
+	point_t v = {p1.x - p2.x, p1.y - p2.y};
+	return v;
+}
+
+/* cross product of o->a and o->b */
+long double cross(point_t o, point_t a, point_t b) {
+	point_t oa = vec(a, o);
+	point_t ob = vec(b, o);
+	return (long double) oa.x * ob.y - (long double) oa.y * ob.x;
+}
+
+/* start an empty segmentation that allows an error of err */
+void pla_init(pla_t *pla, long long err) {
+	memset(pla, 0, sizeof(*pla));
+	pla->err = err;
+}
+
+/* free the memory held by the hulls */
+void pla_free(pla_t *pla) {
+	free(pla->upper.items);
+	free(pla->lower.items);
+}
+
+/* add a point to the current segment, keys must be increasing. returns 0
+ * if no line can cover it together with the previous points, in which
+ * case the segment is closed and the next call starts a new one */
+int pla_add(pla_t *pla, data_t key, long long y) {
+	if (pla->points == 0) {
+		pla->first = key;
+	}
+	long double x = key_diff(key, pla->first);
+	point_t p1 = {x, y + pla->err};
+	point_t p2 = {x, y - pla->err};
+
+	if (pla->points == 0) {
+		pla->rect[0] = p1;
+		pla->rect[1] = p2;
+		pla->upper.len = pla->lower.len = 0;
+		pla->upper_start = pla->lower_start = 0;
+		point_arr_push(&pla->upper, p1);
+		point_arr_push(&pla->lower, p2);
+		pla->points++;
+		return 1;
+	}
+
+	if (pla->points == 1) {
+		pla->rect[2] = p2;
+		pla->rect[3] = p1;
+		point_arr_push(&pla->upper, p1);
+		point_arr_push(&pla->lower, p2);
+		pla->points++;
+		return 1;
+	}
+
+	point_t slope1 = vec(pla->rect[2], pla->rect[0]);
+	point_t slope2 = vec(pla->rect[3], pla->rect[1]);
+	int outside_line1 = slope_cmp(vec(p1, pla->rect[2]), slope1) < 0;
+	int outside_line2 = slope_cmp(vec(p2, pla->rect[3]), slope2) > 0;
+
+	if (outside_line1 || outside_line2) {
+		pla->points = 0;
+		return 0;
+	}
+
+	if (slope_cmp(vec(p1, pla->rect[1]), slope2) < 0) {
+		/* find the new extreme slope on the lower hull */
+		point_t *lower = pla->lower.items;
+		point_t min_slope = vec(lower[pla->lower_start], p1);
+		int min_i = pla->lower_start;
+		for (int i = pla->lower_start + 1; i < pla->lower.len; i++) {
+			point_t val = vec(lower[i], p1);
+			if (slope_cmp(val, min_slope) > 0) {
+				break;
+			}
+			min_slope = val;
+			min_i = i;
+		}
+		pla->rect[1] = lower[min_i];
+		pla->rect[3] = p1;
+		pla->lower_start = min_i;
+
+		/* update the upper hull */
+		point_arr_t *upper = &pla->upper;
+		int end = upper->len;
+		while (end >= pla->upper_start + 2
+				&& cross(upper->items[end - 2], upper->items[end - 1], p1) <= 0) {
+			end--;
+		}
+		upper->len = end;
+		point_arr_push(upper, p1);
+	}
+
+	if (slope_cmp(vec(p2, pla->rect[0]), slope1) > 0) {
+		/* find the new extreme slope on the upper hull */
+		point_t *upper = pla->upper.items;
+		point_t max_slope = vec(upper[pla->upper_start], p2);
+		int max_i = pla->upper_start;
+		for (int i = pla->upper_start + 1; i < pla->upper.len; i++) {
+			point_t val = vec(upper[i], p2);
+			if (slope_cmp(val, max_slope) < 0) {
+				break;
+			}
+			max_slope = val;
+			max_i = i;
+		}
+		pla->rect[0] = upper[max_i];
+		pla->rect[2] = p2;
+		pla->upper_start = max_i;
+
+		/* update the lower hull */
+		point_arr_t *lower = &pla->lower;
+		int end = lower->len;
+		while (end >= pla->lower_start + 2
+				&& cross(lower->items[end - 2], lower->items[end - 1], p2) >= 0) {
+			end--;
+		}
+		lower->len = end;
+		point_arr_push(lower, p2);
+	}
+
+	pla->points++;
+	return 1;
+}
+
+/* the line through the middle of the feasible region of the current
+ * segment, as a slope and the intercept at its first key */
+void pla_model(pla_t *pla, double *slope, double *intercept) {
+	point_t *r = pla->rect;
+	if (pla->points == 1) {
+		*slope = 0;
+		*intercept = (r[0].y + r[1].y) / 2.0;
+		return;
+	}
+
+	/* the two extreme lines r[0]-r[2] and r[1]-r[3] cross at (i_x, i_y) */
+	point_t slope1 = vec(r[2], r[0]);
+	point_t slope2 = vec(r[3], r[1]);
+	long double i_x = r[0].x;
+	long double i_y = r[0].y;
+	long double det = (long double) slope1.x * slope2.y - (long double) slope1.y * slope2.x;
+	if (det != 0) {
+		long double t = ((long double) (r[1].x - r[0].x) * slope2.y
+			- (long double) (r[1].y - r[0].y) * slope2.x) / det;
+		i_x += t * slope1.x;
+		i_y += t * slope1.y;
+	}
+
+	long double min_slope = (long double) slope1.y / slope1.x;
+	long double max_slope = (long double) slope2.y / slope2.x;
+	long double mid_slope = (min_slope + max_slope) / 2;
+
+	/* keep the model non-decreasing, so that a key between two
+	 * modelled keys is predicted between their positions */
+	if (mid_slope < 0) {
+		mid_slope = 0;
+	}
+	*slope = mid_slope;
+	*intercept = i_y - i_x * mid_slope;
+}
+
+/* build the recursive model layer over the max elements of the
+ * mappings, adding levels until the root fits in a cache line */
+void build_levels(map_t mappings[], int mps_len, level_arr_t *levels) {
+	data_t *keys = (data_t*)malloc(sizeof(*keys) * mps_len);
+	assert(keys!=NULL);
+	for (int i = 0; i < mps_len; i++) {
+		keys[i] = mappings[i].max;
+	}
+	int len = mps_len;
+
+	while (1) {
+		level_t level = {keys, len, {NULL, 0, 0}, NULL};
+		if (len > ROOT_KEYS) {
+			map_arr_init(&level.models, INIT_CAPACITY);
+			build_cone(keys, len, LEVEL_ERR, &level.models);
+		}
+
+		/* stop at a small enough root, or if a level would not shrink */
+		if (len <= ROOT_KEYS || level.models.len >= len) {
+			map_arr_free(&level.models);
+			level_arr_push(levels, level);
+			return;
+		}
+
+		/* each model starts right after the keys covered by the previous one */
+		int m = level.models.len;
+		level.starts = (int*)malloc(sizeof(*level.starts) * m);
+		data_t *next = (data_t*)malloc(sizeof(*next) * m);
+		assert(level.starts!=NULL && next!=NULL);
+		for (int i = 0, k = 0; i < m; i++) {
+			level.starts[i] = k;
+			next[i] = level.models.items[i].max;
+			while (k < len && keys[k] <= next[i]) {
+				k++;
+			}
+		}
+
+		level_arr_push(levels, level);
+		keys = next;
+		len = m;
+	}
+}
+
+/* append a level, doubling the capacity when the array is full */
+void level_arr_push(level_arr_t *arr, level_t value) {
+	if (arr->len == arr->cap) {
+		arr->cap = max(arr->cap * 2, INIT_CAPACITY);
+		arr->items = (level_t*)realloc(arr->items, sizeof(*arr->items) * arr->cap);
+		assert(arr->items!=NULL);
+	}
+	arr->items[arr->len++] = value;
+}
+
+/* free the memory held by the recursive model layer */
+void free_levels(level_arr_t *levels) {
+	for (int i = 0; i < levels->len; i++) {
+		free(levels->items[i].keys);
+		free(levels->items[i].starts);
+		map_arr_free(&levels->items[i].models);
+	}
+	free(levels->items);
+	levels->items = NULL;
+	levels->len = levels->cap = 0;
+}
+
+/* find the mapping function for key through the recursive model
+ * layer: scan the root, then let each level's model predict the
+ * position in the level below and search only within LEVEL_ERR of it */
+int search_levels(level_arr_t *levels, data_t *key, int *locn) {
+	level_t *root = &levels->items[levels->len - 1];
+
+	/* the root fits in a cache line, so scanning it is cheap */
+	int j = 0;
+	while (j < root->len - 1 && cmp(key, &root->keys[j]) > 0) {
+		trace_probe(root->keys[j]);
+		j++;
+	}
+	trace_probe(root->keys[j]);
+
+	for (int l = levels->len - 2; l >= 0; l--) {
+		level_t *level = &levels->items[l];
+		map_t *model = &level->models.items[j];
+		int start = level->starts[j];
+		int end = j + 1 < level->models.len
+			? level->starts[j + 1] - 1
+			: level->len - 1;
+
+		/* a key between two modelled keys may be off by one more
+		 * position, and keys before the model's first one are
+		 * clamped to the start of the model */
+		int pos = predict_pos(*key, model, start, end);
+		search_level(
+			level->keys,
+			max(start, pos - LEVEL_ERR - 1),
+			min(end, pos + LEVEL_ERR + 1) + 1,
+			key,
+			&j
+		);
+	}
+
+	*locn = j;
+	return BS_FOUND;
 }
 
 /* stage 4: perform exact-match queries */
 /* algorithms are fun */
-void stage_four(data_t dataset[], map_t mappings[], int mps_len, int max_err) {
+void stage_four(index_t *index) {
 	/* print stage header */
 	print_stage_header(STAGE_NUM_FOUR);
 
+	data_t *dataset = index->dataset;
+	map_t *mappings = index->mappings;
+	int n = index->n;
+	int max_err = index->max_err;
+
 	data_t key = 0;
-	while (scanf("%d", &key) == 1) { /* read remaining inputs */
-		printf("Searching for %d:\n", key);
+	while (read_key(&key) == 1) { /* read remaining inputs */
+		printf("Searching for %s:\n", key_str(key));
 
 		/* check if key is within the dataset's range */
 		printf("Step 1: ");
-		if (key < dataset[0] || key > dataset[DATASET_SIZE - 1]) {
+		if (key < dataset[0] || key > dataset[n - 1]) {
 			printf("not found!\n");
+			STAT(stats_lookup(0, 0, 0, BS_NOT_FOUND, max_err);)
 			continue;
 		}
 		printf("search key in data domain.\n");
@@ -254,17 +1622,24 @@ void stage_four(data_t dataset[], map_t mappings[], int mps_len, int max_err) {
 		/* find the data domain that is valid for key */
 		printf("Step 2:");
 		int map_index = 0;
-		search_mappings(mappings, 0, mps_len, &key, &map_index);
+		if (index->levels->len > 0) {
+			search_levels(index->levels, &key, &map_index);
+		} else {
+			search_mappings(mappings, 0, index->mps_len, &key, &map_index);
+		}
 		printf("\n");
+		STAT(int p2 = stats.traced; stats.traced = 0;)
 
 		/* find the index of key in dataset */
 		printf("Step 3:");
 		int key_index = 0;
-		int f_key = ceil(compute_f_key(key, mappings[map_index].a, mappings[map_index].b));
+		/* clamped just past the reach of the window, so that the
+		 * window and the steps printed are unchanged */
+		int f_key = predict_pos(key, &mappings[map_index], -1 - max_err, n + max_err);
 		int found = search_key(
 			dataset,
 			max(0, f_key - max_err),
-			min(DATASET_SIZE-1, f_key + max_err) + 1,
+			min(n-1, f_key + max_err) + 1,
 			&key,
 			&key_index
 		);
@@ -273,18 +1648,2445 @@ void stage_four(data_t dataset[], map_t mappings[], int mps_len, int max_err) {
 		} else {
 			printf(" not found!\n");
 		}
+		STAT(stats_lookup(p2, stats.traced, f_key, found == 0 ? key_index : BS_NOT_FOUND, max_err);)
+		STAT(stats.traced = 0;)
 	}
 	
 	printf("\n");
 }
 
 /****************************************************************/
-/* functions provided, adapt them as appropriate */
+/* quiet lookups used by the batch mode and the benchmark */
 
-/* print stage header given stage number */
-void print_stage_header(int stage_num) {
-	printf(STAGE_HEADER, stage_num);
-}
+/* stage 4 in batch mode: read all queries, then answer them at once,
+ * split between threads */
+void stage_four_batch(index_t *index, int pipe, int threads) {
+	/* print stage header */
+	print_stage_header(STAGE_NUM_FOUR);
+
+	data_arr_t keys;
+	data_arr_init(&keys, INIT_CAPACITY);
+	data_t key = 0;
+	while (read_key(&key) == 1) {
+		data_arr_push(&keys, key);
+	}
+
+	int *out = (int*)malloc(sizeof(*out) * max(keys.len, 1));
+	assert(out!=NULL);
+	pool_t pool;
+	pool_start(&pool, index, threads);
+	pool_run(&pool, keys.items, keys.len, out, pipe);
+	pool_stop(&pool);
+
+	for (int i = 0; i < keys.len; i++) {
+		if (out[i] != BS_NOT_FOUND) {
+			printf("Searching for %s: @ dataset[%d]!\n", key_str(keys.items[i]), out[i]);
+		} else {
+			printf("Searching for %s: not found!\n", key_str(keys.items[i]));
+		}
+	}
+
+	printf("\n");
+	free(out);
+	data_arr_free(&keys);
+}
+
+/* time the scalar, batch and pipelined lookups on the same random
+ * queries, half of them keys from the dataset and half uniform in
+ * its range, then the pipelined lookups on 1 up to threads threads */
+void bench_lookups(index_t *index, int count, int threads) {
+	printf(BENCH_HEADER);
+
+	/* the mappings first, the compact table last */
+	compact_t *compact = index->compact;
+	index->compact = NULL;
+
+	data_t *keys = (data_t*)malloc(sizeof(*keys) * count);
+	int *scalar = (int*)malloc(sizeof(*scalar) * count);
+	int *batch = (int*)malloc(sizeof(*batch) * count);
+	int *piped = (int*)malloc(sizeof(*piped) * count);
+	assert(keys!=NULL && scalar!=NULL && batch!=NULL && piped!=NULL);
+
+	unsigned long long state = 42;
+	data_t lo = index->dataset[0], hi = index->dataset[index->n - 1];
+	for (int i = 0; i < count; i++) {
+		unsigned long long r = next_rand(&state);
+		keys[i] = i % 2 == 0
+			? index->dataset[r % index->n]
+			: key_between(lo, hi, r);
+	}
+
+	double start = now_sec();
+	for (int i = 0; i < count; i++) {
+		scalar[i] = lookup_scalar(index, keys[i]);
+	}
+	double scalar_time = now_sec() - start;
+
+	start = now_sec();
+	lookup_batch(index, keys, count, batch);
+	double batch_time = now_sec() - start;
+
+	start = now_sec();
+	lookup_pipelined(index, keys, count, piped);
+	double pipe_time = now_sec() - start;
+
+	/* both must agree, although they may find different duplicates */
+	int found = 0, mismatches = 0;
+	for (int i = 0; i < count; i++) {
+		found += batch[i] != BS_NOT_FOUND;
+		if ((scalar[i] == BS_NOT_FOUND) != (batch[i] == BS_NOT_FOUND)
+				|| (batch[i] != BS_NOT_FOUND && index->dataset[batch[i]] != keys[i])
+				|| piped[i] != batch[i]) {
+			mismatches++;
+		}
+	}
+
+	printf("Queries: %d (%d found, %d mismatches)\n", count, found, mismatches);
+	printf("Scalar: %8.2f Mq/s\n", count / scalar_time / 1e6);
+	printf("Batch:  %8.2f Mq/s (%.2fx)\n", count / batch_time / 1e6,
+		scalar_time / batch_time);
+	printf("Piped:  %8.2f Mq/s (%.2fx)\n", count / pipe_time / 1e6,
+		scalar_time / pipe_time);
+
+	/* the same lookups served by the pool, doubling the threads */
+	double one_time = 0;
+	for (int t = 1; t <= threads; t = min(t * 2, threads)) {
+		pool_t pool;
+		pool_start(&pool, index, t);
+		start = now_sec();
+		pool_run(&pool, keys, count, batch, 1);
+		double pool_time = now_sec() - start;
+		pool_stop(&pool);
+
+		mismatches = 0;
+		for (int i = 0; i < count; i++) {
+			mismatches += batch[i] != piped[i];
+		}
+
+		/* the shares again, one after the other on this thread. with a
+		 * core each they would take as long as the longest one, which
+		 * bounds the speedup even where the cores are not there */
+		double total = 0, longest = 0;
+		for (int id = 0; id < pool.threads; id++) {
+			start = now_sec();
+			pool_share(&pool, id);
+			double time = now_sec() - start;
+			total += time;
+			longest = fmax(longest, time);
+		}
+		one_time = t == 1 ? pool_time : one_time;
+		printf("Threads %2d: %8.2f Mq/s (%.2fx, split %.2fx), %d mismatches\n", t,
+			count / pool_time / 1e6, one_time / pool_time, total / longest, mismatches);
+		if (t == threads) {
+			break;
+		}
+	}
+
+	index->compact = compact;
+	if (compact != NULL) {
+		start = now_sec();
+		lookup_pipelined(index, keys, count, batch);
+		double compact_time = now_sec() - start;
+
+		mismatches = 0;
+		for (int i = 0; i < count; i++) {
+			mismatches += batch[i] != piped[i];
+		}
+		printf("Compact: %8.2f Mq/s (%.2fx), %d mismatches\n",
+			count / compact_time / 1e6, scalar_time / compact_time, mismatches);
+		printf("Index bytes: %lld mappings, %lld compact\n",
+			(long long) sizeof(map_t) * index->mps_len, compact_bytes(compact));
+	}
+	printf("\n");
+
+	free(keys);
+	free(scalar);
+	free(batch);
+	free(piped);
+}
+
+/* look up a single key with the Step 1 to Step 3 searches of stage 4,
+ * without the printing */
+int lookup_scalar(index_t *index, data_t key) {
+	data_t *dataset = index->dataset;
+	if (key < dataset[0] || key > dataset[index->n - 1]) {
+		STAT(stats_lookup(0, 0, 0, BS_NOT_FOUND, index->max_err);)
+		return BS_NOT_FOUND;
+	}
+
+	/* Step 2: binary search over the max elements */
+	int map_index = 0;
+	STAT(int p2 = 0, p3 = 0;)
+	if (index->levels->len > 0) {
+		map_index = find_mapping(index, key);
+		STAT(p2 = stats.last2;)
+	} else {
+		int lo = 0, hi = index->mps_len;
+		while (lo < hi) {
+			int mid = (lo+hi)/2;
+			STAT(p2++;)
+			int outcome = cmp(&key, &index->mappings[mid].max);
+			if (outcome < 0) {
+				hi = mid;
+			} else if (outcome > 0) {
+				lo = mid+1;
+			} else {
+				lo = hi = mid;
+			}
+		}
+		map_index = lo;
+	}
+
+	/* Step 3: binary search within max_err of the prediction */
+	map_t *map = &index->mappings[map_index];
+	int f_key = predict_pos(key, map, 0, index->n - 1);
+	int lo = max(0, f_key - index->max_err);
+	int hi = min(index->n - 1, f_key + index->max_err) + 1;
+	while (lo < hi) {
+		int mid = (lo+hi)/2;
+		STAT(p3++;)
+		int outcome = cmp(&key, dataset + mid);
+		if (outcome < 0) {
+			hi = mid;
+		} else if (outcome > 0) {
+			lo = mid+1;
+		} else {
+			STAT(stats_lookup(p2, p3, f_key, mid, index->max_err);)
+			return mid;
+		}
+	}
+	STAT(stats_lookup(p2, p3, f_key, BS_NOT_FOUND, index->max_err);)
+	return BS_NOT_FOUND;
+}
+
+/* look up count keys at once, out[i] is the first position of keys[i]
+ * in the dataset or BS_NOT_FOUND. keys are taken BATCH_GROUP at a
+ * time: their mappings are searched in lockstep, their models are
+ * evaluated together, and each error window is scanned with SIMD
+ * compares instead of a binary search */
+void lookup_batch(index_t *index, data_t keys[], int count, int out[]) {
+	int maps[BATCH_GROUP];
+	int pos[BATCH_GROUP];
+	if (index->compact != NULL) {
+		lookup_compact(index, keys, count, out);
+		return;
+	}
+
+	for (int g = 0; g < count; g += BATCH_GROUP) {
+		int size = min(BATCH_GROUP, count - g);
+		find_mappings(index, keys + g, size, maps);
+		predict_positions(index, keys + g, maps, size, pos);
+		for (int i = 0; i < size; i++) {
+			out[g + i] = search_window(index, keys[g + i], pos[i]);
+			STAT(int len = min(index->n - 1, pos[i] + index->max_err) + 1
+				- max(0, pos[i] - index->max_err);)
+			STAT(stats_lookup(stats.group2[i], search_probes(len, SCAN_MAX), pos[i],
+				out[g + i], index->max_err);)
+		}
+	}
+}
+
+/* look up count keys like lookup_batch, keeping PIPE_GROUP of them in
+ * flight to hide the cache misses of large indexes: every step of a
+ * search prefetches the next probe of its key and moves on to the
+ * other keys of the group, so the misses of the whole group overlap
+ * (group prefetching). the error windows are narrowed the same way,
+ * prefetching only the lines the next probes touch */
+void lookup_pipelined(index_t *index, data_t keys[], int count, int out[]) {
+	int maps[PIPE_GROUP];
+	int pos[PIPE_GROUP];
+	level_arr_t *levels = index->levels;
+	map_t *mappings = index->mappings;
+	if (index->compact != NULL) {
+		lookup_compact(index, keys, count, out);
+		return;
+	}
+
+	for (int g = 0; g < count; g += PIPE_GROUP) {
+		int size = min(PIPE_GROUP, count - g);
+		data_t *k = keys + g;
+
+		if (levels->len == 0) {
+			/* lockstep binary search over the max elements */
+			int len = index->mps_len;
+			for (int i = 0; i < size; i++) {
+				maps[i] = 0;
+			}
+			while (len > 1) {
+				int half = len / 2;
+				int next = (len - half) / 2;
+				for (int i = 0; i < size; i++) {
+					maps[i] += (mappings[maps[i] + half - 1].max < k[i]) * half;
+					PREFETCH(&mappings[maps[i] + next]);
+				}
+				len -= half;
+			}
+			for (int i = 0; i < size; i++) {
+				maps[i] += mappings[maps[i]].max < k[i];
+				maps[i] = min(maps[i], index->mps_len - 1);
+				STAT(stats.group2[i] = search_probes(index->mps_len, 1);)
+			}
+		} else {
+			/* scan the root, then descend one level at a time, with
+			 * each key's window of the level prefetched in between */
+			level_t *root = &levels->items[levels->len - 1];
+			for (int i = 0; i < size; i++) {
+				maps[i] = min(count_less(root->keys, root->len, k[i]), root->len - 1);
+				STAT(stats.group2[i] = root->len;)
+			}
+			for (int l = levels->len - 2; l >= 0; l--) {
+				level_t *level = &levels->items[l];
+				int lo[PIPE_GROUP], hi[PIPE_GROUP];
+				for (int i = 0; i < size; i++) {
+					int j = maps[i];
+					map_t *model = &level->models.items[j];
+					int start = level->starts[j];
+					int end = j + 1 < level->models.len
+						? level->starts[j + 1] - 1
+						: level->len - 1;
+					int p = predict_pos(k[i], model, start, end);
+					lo[i] = max(start, p - LEVEL_ERR - 1);
+					hi[i] = min(end, p + LEVEL_ERR + 1) + 1;
+					prefetch_window(level->keys, lo[i], hi[i]);
+					STAT(stats.group2[i] += search_probes(hi[i] - lo[i], SCAN_MAX);)
+				}
+				for (int i = 0; i < size; i++) {
+					maps[i] = lower_bound(level->keys, lo[i], hi[i], k[i]);
+					if (l > 0) {
+						PREFETCH(&levels->items[l - 1].models.items[maps[i]]);
+						PREFETCH(&levels->items[l - 1].starts[maps[i]]);
+					} else {
+						PREFETCH(&mappings[min(maps[i], index->mps_len - 1)]);
+					}
+				}
+			}
+			for (int i = 0; i < size; i++) {
+				maps[i] = min(maps[i], index->mps_len - 1);
+			}
+		}
+
+		/* predict, then narrow every error window in lockstep */
+		predict_positions(index, k, maps, size, pos);
+		search_windows(index, k, pos, size, index->max_err, out + g);
+	}
+}
+
+/* search count keys within err of their predicted positions pos[i],
+ * narrowing every window in lockstep with only the cache lines of the
+ * next probes prefetched, out[i] is the position of keys[i] or
+ * BS_NOT_FOUND */
+void search_windows(index_t *index, data_t keys[], int pos[], int count, int err, int out[]) {
+	data_t *dataset = index->dataset;
+	int lo[PIPE_GROUP], len[PIPE_GROUP];
+	STAT(int p3[PIPE_GROUP];)
+	int wide = 0;
+	for (int i = 0; i < count; i++) {
+		lo[i] = max(0, pos[i] - err);
+		len[i] = min(index->n - 1, pos[i] + err) + 1 - lo[i];
+		STAT(p3[i] = search_probes(len[i], SCAN_MAX);)
+		if (len[i] > SCAN_MAX) {
+			PREFETCH(dataset + lo[i] + len[i] / 2 - 1);
+			wide = 1;
+		} else {
+			prefetch_window(dataset, lo[i], lo[i] + len[i]);
+		}
+	}
+	while (wide) {
+		wide = 0;
+		for (int i = 0; i < count; i++) {
+			if (len[i] <= SCAN_MAX) {
+				continue;
+			}
+			int half = len[i] / 2;
+			lo[i] += (dataset[lo[i] + half - 1] < keys[i]) * half;
+			len[i] -= half;
+			if (len[i] > SCAN_MAX) {
+				PREFETCH(dataset + lo[i] + len[i] / 2 - 1);
+				wide = 1;
+			} else {
+				prefetch_window(dataset, lo[i], lo[i] + len[i]);
+			}
+		}
+	}
+	for (int i = 0; i < count; i++) {
+		int locn = lo[i] + count_less(dataset + lo[i], len[i], keys[i]);
+		out[i] = locn < lo[i] + len[i] && dataset[locn] == keys[i]
+			? locn
+			: BS_NOT_FOUND;
+		STAT(stats_lookup(stats.group2[i], p3[i], pos[i], out[i], index->max_err);)
+	}
+}
+
+/* prefetch the cache lines of keys[lo..hi-1], at most PREFETCH_LINES
+ * of them around the middle of wide windows */
+void prefetch_window(data_t keys[], int lo, int hi) {
+	int per_line = CACHE_LINE / (int) sizeof(data_t);
+	int span = PREFETCH_LINES * per_line;
+	if (hi - lo > span) {
+		lo = (lo + hi - span) / 2;
+		hi = lo + span;
+	}
+	for (int i = lo; i < hi; i += per_line) {
+		PREFETCH(keys + i);
+	}
+	PREFETCH(keys + hi - 1);
+}
+
+/* find the mapping function for key without printing, keys outside
+ * the data domain are given the first or the last function */
+int find_mapping(index_t *index, data_t key) {
+	level_arr_t *levels = index->levels;
+	if (levels->len == 0) {
+		int map_index = 0;
+		find_mappings(index, &key, 1, &map_index);
+		return map_index;
+	}
+
+	level_t *root = &levels->items[levels->len - 1];
+	int j = min(count_less(root->keys, root->len, key), root->len - 1);
+	STAT(stats.last2 = root->len;)
+
+	for (int l = levels->len - 2; l >= 0; l--) {
+		level_t *level = &levels->items[l];
+		map_t *model = &level->models.items[j];
+		int start = level->starts[j];
+		int end = j + 1 < level->models.len
+			? level->starts[j + 1] - 1
+			: level->len - 1;
+		int pos = predict_pos(key, model, start, end);
+		int lo = max(start, pos - LEVEL_ERR - 1);
+		int hi = min(end, pos + LEVEL_ERR + 1) + 1;
+		j = lower_bound(level->keys, lo, hi, key);
+		STAT(stats.last2 += search_probes(hi - lo, SCAN_MAX);)
+	}
+
+	return min(j, index->mps_len - 1);
+}
+
+/* find the mapping functions of count keys. without the recursive
+ * model layer, every key takes the same number of steps of a
+ * branchless binary search, so the searches run in lockstep and
+ * their cache misses overlap */
+void find_mappings(index_t *index, data_t keys[], int count, int maps[]) {
+	if (index->levels->len > 0) {
+		for (int i = 0; i < count; i++) {
+			maps[i] = find_mapping(index, keys[i]);
+			STAT(stats.group2[i] = stats.last2;)
+		}
+		return;
+	}
+
+	map_t *mappings = index->mappings;
+	for (int i = 0; i < count; i++) {
+		maps[i] = 0;
+	}
+	int len = index->mps_len;
+	while (len > 1) {
+		int half = len / 2;
+		for (int i = 0; i < count; i++) {
+			maps[i] += (mappings[maps[i] + half - 1].max < keys[i]) * half;
+		}
+		len -= half;
+	}
+	for (int i = 0; i < count; i++) {
+		maps[i] += mappings[maps[i]].max < keys[i];
+		maps[i] = min(maps[i], index->mps_len - 1);
+		STAT(stats.group2[i] = search_probes(index->mps_len, 1);)
+	}
+}
+
+/* evaluate the mapping functions of count keys, with the predicted
+ * positions clamped to the dataset */
+void predict_positions(index_t *index, data_t keys[], int maps[], int count, int pos[]) {
+	map_t *mappings = index->mappings;
+	double last = index->n - 1;
+	int i = 0;
+
+#if defined(__AVX2__) && defined(KEY_INT32)
+	/* four models at a time, int keys convert to doubles exactly */
+	__m256d zero = _mm256_setzero_pd();
+	__m256d top = _mm256_set1_pd(last);
+	for (; i + 4 <= count; i += 4) {
+		map_t *m0 = &mappings[maps[i]], *m1 = &mappings[maps[i + 1]];
+		map_t *m2 = &mappings[maps[i + 2]], *m3 = &mappings[maps[i + 3]];
+		__m256d a = _mm256_set_pd(m3->a, m2->a, m1->a, m0->a);
+		__m256d b = _mm256_set_pd(m3->b, m2->b, m1->b, m0->b);
+		__m256d o = _mm256_set_pd(m3->origin, m2->origin, m1->origin, m0->origin);
+		__m256d k = _mm256_cvtepi32_pd(_mm_loadu_si128((__m128i*) (keys + i)));
+
+		/* f(key) = (key - origin) / b + a, or a for the constant functions */
+		__m256d f = _mm256_add_pd(_mm256_div_pd(_mm256_sub_pd(k, o), b), a);
+		f = _mm256_blendv_pd(f, a, _mm256_cmp_pd(b, zero, _CMP_EQ_OQ));
+		f = _mm256_min_pd(_mm256_max_pd(_mm256_ceil_pd(f), zero), top);
+		_mm_storeu_si128((__m128i*) (pos + i), _mm256_cvttpd_epi32(f));
+	}
+#endif
+
+	for (; i < count; i++) {
+		map_t *map = &mappings[maps[i]];
+		pos[i] = predict_pos(keys[i], map, 0, last);
+	}
+}
+
+/* find key within max_err of its predicted position */
+int search_window(index_t *index, data_t key, int pos) {
+	int lo = max(0, pos - index->max_err);
+	int hi = min(index->n - 1, pos + index->max_err) + 1;
+	int locn = lower_bound(index->dataset, lo, hi, key);
+	return locn < hi && index->dataset[locn] == key
+		? locn
+		: BS_NOT_FOUND;
+}
+
+/* position of the first key not smaller than key in keys[lo..hi-1]:
+ * wide windows are narrowed with a branchless binary search and the
+ * last SCAN_MAX keys are counted with SIMD compares */
+int lower_bound(data_t keys[], int lo, int hi, data_t key) {
+	data_t *base = keys + lo;
+	int len = hi - lo;
+	while (len > SCAN_MAX) {
+		int half = len / 2;
+		base += (base[half - 1] < key) * half;
+		len -= half;
+	}
+	return (base - keys) + count_less(base, len, key);
+}
+
+/* count the keys in keys[0..len-1] that are smaller than key */
+int count_less(data_t keys[], int len, data_t key) {
+	int count = 0, i = 0;
+
+#if defined(KEY_INT32)
+#if defined(__AVX2__)
+	__m256i k8 = _mm256_set1_epi32(key);
+	__m256i acc8 = _mm256_setzero_si256();
+	for (; i + 8 <= len; i += 8) {
+		__m256i v = _mm256_loadu_si256((__m256i*) (keys + i));
+		acc8 = _mm256_sub_epi32(acc8, _mm256_cmpgt_epi32(k8, v));
+	}
+	__m128i acc = _mm_add_epi32(_mm256_castsi256_si128(acc8),
+		_mm256_extracti128_si256(acc8, 1));
+#elif defined(__SSE2__)
+	__m128i acc = _mm_setzero_si128();
+#endif
+
+#if defined(__SSE2__) || defined(__AVX2__)
+	__m128i k4 = _mm_set1_epi32(key);
+	for (; i + 4 <= len; i += 4) {
+		__m128i v = _mm_loadu_si128((__m128i*) (keys + i));
+		acc = _mm_sub_epi32(acc, _mm_cmpgt_epi32(k4, v));
+	}
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+	count = _mm_cvtsi128_si32(acc);
+#endif
+
+#elif defined(__AVX2__)
+	/* four 8-byte keys at a time, unsigned keys are compared as signed
+	 * ones with their top bits flipped */
+	__m256i acc = _mm256_setzero_si256();
+#if defined(KEY_DOUBLE)
+	__m256d k4 = _mm256_set1_pd(key);
+	for (; i + 4 <= len; i += 4) {
+		__m256d v = _mm256_loadu_pd(keys + i);
+		acc = _mm256_sub_epi64(acc, _mm256_castpd_si256(_mm256_cmp_pd(v, k4, _CMP_LT_OQ)));
+	}
+#else
+#if defined(KEY_STRING)
+	__m256i flip = _mm256_set1_epi64x(LLONG_MIN);
+#else
+	__m256i flip = _mm256_setzero_si256();
+#endif
+	__m256i k4 = _mm256_xor_si256(_mm256_set1_epi64x(key), flip);
+	for (; i + 4 <= len; i += 4) {
+		__m256i v = _mm256_xor_si256(_mm256_loadu_si256((__m256i*) (keys + i)), flip);
+		acc = _mm256_sub_epi64(acc, _mm256_cmpgt_epi64(k4, v));
+	}
+#endif
+	long long lanes[4];
+	_mm256_storeu_si256((__m256i*) lanes, acc);
+	count = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+
+	for (; i < len; i++) {
+		count += keys[i] < key;
+	}
+	return count;
+}
+
+/* wall clock time in seconds */
+double now_sec(void) {
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* xorshift64* pseudo random numbers, reproducible across platforms */
+unsigned long long next_rand(unsigned long long *state) {
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 2685821657736338717ULL;
+}
+
+/****************************************************************/
+/* compact segment table */
+
+/* pack the mappings of the index into a compact table for it to use,
+ * and measure how much further than max_err the rounded models predict
+ * a key */
+void build_compact(index_t *index, compact_t *compact) {
+	int m = index->mps_len;
+	size_t size = sizeof(*compact->keys) * (m + 1);
+	compact->keys = (data_t*)aligned_alloc(CACHE_LINE,
+		(size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE);
+	compact->models = (cmodel_t*)malloc(sizeof(*compact->models) * (m + 1));
+	int *slots = (int*)malloc(sizeof(*slots) * m);
+	assert(compact->keys!=NULL && compact->models!=NULL && slots!=NULL);
+	compact->len = m;
+	compact->depth = search_depth(m);
+	compact->slack = 0;
+	fill_compact(index, compact, 0, 1, slots);
+	compact->last = slots[m - 1];
+	index->compact = compact;
+
+	/* every key is looked up in the first segment whose max is not
+	 * smaller, or in the last one, and is found if the window holds
+	 * any of its copies dataset[first..last] */
+	data_t *dataset = index->dataset;
+	for (int i = 0, first = 0; first < index->n; first++) {
+		int last = first;
+		while (last + 1 < index->n && dataset[last + 1] == dataset[first]) {
+			last++;
+		}
+		while (i < m - 1 && dataset[first] > index->mappings[i].max) {
+			i++;
+		}
+		int pos = compact_predict(index, slots[i], dataset[first]);
+		int off = pos < first ? first - pos : pos > last ? pos - last : 0;
+		compact->slack = max(compact->slack, off - index->max_err);
+		first = last;
+	}
+	compact->slack = min(compact->slack, index->n);
+	free(slots);
+}
+
+/* fill the subtree of slot k in order with the mappings from i on,
+ * returns the first mapping left. slots[i] is the slot of mapping i */
+int fill_compact(index_t *index, compact_t *compact, int i, int k, int slots[]) {
+	if (k > compact->len) {
+		return i;
+	}
+	i = fill_compact(index, compact, i, 2 * k, slots);
+
+	map_t *map = &index->mappings[i];
+	cmodel_t *model = &compact->models[k];
+	compact->keys[k] = map->max;
+	double base = map->b == 0 ? ceil(map->a) : floor(compute_f_key(map->max, map) + 0.5);
+	float slope = map->b == 0 ? 0 : 1 / map->b;
+	if (isfinite(slope) && fabs(base) < INT_MAX) {
+		model->base = base;
+		model->slope = slope;
+	} else {
+		model->base = i;
+		model->slope = NAN;
+	}
+	slots[i] = k;
+
+	return fill_compact(index, compact, i + 1, 2 * k + 1, slots);
+}
+
+/* position of key predicted by the model of slot k, clamped to the
+ * dataset. a prediction that is not a number gives 0 */
+int compact_predict(index_t *index, int k, data_t key) {
+	compact_t *compact = index->compact;
+	cmodel_t *model = &compact->models[k];
+	if (isnan(model->slope)) {
+		return predict_pos(key, &index->mappings[model->base], 0, index->n - 1);
+	}
+	double f = ceil(model->base + key_diff(key, compact->keys[k]) * model->slope);
+	return f > 0 ? (f < index->n - 1 ? (int) f : index->n - 1) : 0;
+}
+
+/* look up count keys like lookup_pipelined, with the compact table.
+ * the Eytzinger searches of a group run in lockstep without branches:
+ * every key takes depth steps, staying put once it has left the tree,
+ * and each step prefetches the line holding the slots a few levels
+ * below. the slot of the first max not smaller than the key is then
+ * found by dropping the right turns taken after the last left one */
+void lookup_compact(index_t *index, data_t keys[], int count, int out[]) {
+	compact_t *compact = index->compact;
+	data_t *tree = compact->keys;
+	int len = compact->len;
+	int err = index->max_err + compact->slack;
+	int per_line = CACHE_LINE / (int) sizeof(data_t);
+
+	for (int g = 0; g < count; g += PIPE_GROUP) {
+		int size = min(PIPE_GROUP, count - g);
+		data_t *k = keys + g;
+		int slot[PIPE_GROUP], pos[PIPE_GROUP];
+
+		for (int i = 0; i < size; i++) {
+			slot[i] = 1;
+		}
+		for (int d = 0; d < compact->depth; d++) {
+			for (int i = 0; i < size; i++) {
+				int s = slot[i];
+				int step = 2 * s + (tree[min(s, len)] < k[i]);
+				slot[i] = s <= len ? step : s;
+				PREFETCH(tree + min(per_line * slot[i], len));
+			}
+		}
+
+		/* predict, then narrow the windows widened by the slack */
+		for (int i = 0; i < size; i++) {
+			int s = slot[i] >> __builtin_ffs(~slot[i]);
+			s = s == 0 ? compact->last : s;
+			pos[i] = compact_predict(index, s, k[i]);
+			STAT(stats.group2[i] = compact->depth;)
+		}
+		search_windows(index, k, pos, size, err, out + g);
+	}
+}
+
+/* memory held by the compact table */
+long long compact_bytes(compact_t *compact) {
+	return (long long) (sizeof(*compact->keys) + sizeof(*compact->models))
+		* (compact->len + 1);
+}
+
+/* free the memory held by the compact table */
+void free_compact(compact_t *compact) {
+	free(compact->keys);
+	free(compact->models);
+	compact->keys = NULL;
+	compact->models = NULL;
+	compact->len = 0;
+}
+
+/****************************************************************/
+/* lower-bound, upper-bound and range queries */
+
+/* stage 4 with lower-bound, upper-bound or range queries */
+void stage_four_bounds(index_t *index, int query) {
+	/* print stage header */
+	print_stage_header(STAGE_NUM_FOUR);
+
+	data_t key = 0, hi = 0;
+	while (read_key(&key) == 1) {
+		if (query == QUERY_RANGE) {
+			if (read_key(&hi) != 1) {
+				break;
+			}
+
+			/* count the keys, then stream out the first few of them */
+			printf("Range [%s, %s]: %d keys", key_str(key), key_str(hi),
+				range_count(index, key, hi));
+			range_iter_t it = range_iter(index, key, hi);
+			data_t value;
+			for (int i = 0; range_next(&it, &value); i++) {
+				if (i == DATA_OUTPUT_SIZE) {
+					printf(" ...");
+					break;
+				}
+				printf("%s %s", i == 0 ? ":" : "", key_str(value));
+			}
+			printf("\n");
+			continue;
+		}
+
+		int locn = query == QUERY_LOWER
+			? lookup_lower_bound(index, key)
+			: lookup_upper_bound(index, key);
+		printf("%s bound of %s:", query == QUERY_LOWER ? "Lower" : "Upper", key_str(key));
+		if (locn < index->n) {
+			printf(" %s @ dataset[%d]!\n", key_str(index->dataset[locn]), locn);
+		} else {
+			printf(" not found!\n");
+		}
+	}
+
+	printf("\n");
+}
+
+/* position of the first key in the dataset that is not smaller than
+ * key, or n if there is none. a key that is not in the dataset can be
+ * predicted one position further off than max_err, and a key between
+ * two mapping functions is covered by neither of them, so the answer
+ * is checked and the search gallops outwards if the window missed it */
+int lookup_lower_bound(index_t *index, data_t key) {
+	data_t *dataset = index->dataset;
+	int n = index->n;
+	if (key <= dataset[0]) {
+		return 0;
+	}
+	if (key > dataset[n - 1]) {
+		return n;
+	}
+
+	int map_index = find_mapping(index, key);
+	int pos = 0;
+	predict_positions(index, &key, &map_index, 1, &pos);
+	int lo = max(0, pos - index->max_err - 1);
+	int hi = min(n, pos + index->max_err + 2);
+	int locn = lower_bound(dataset, lo, hi, key);
+
+	if (locn == lo && lo > 0 && dataset[lo - 1] >= key) {
+		/* gallop to the left */
+		int step = 1;
+		do {
+			hi = lo;
+			lo = max(0, lo - step);
+			step *= 2;
+		} while (lo > 0 && dataset[lo - 1] >= key);
+		locn = lower_bound(dataset, lo, hi, key);
+	} else if (locn == hi && hi < n) {
+		/* gallop to the right */
+		int step = 1;
+		do {
+			lo = hi;
+			hi = min(n, hi + step);
+			step *= 2;
+		} while (hi < n && dataset[hi - 1] < key);
+		locn = lower_bound(dataset, lo, hi, key);
+	}
+
+	return locn;
+}
+
+/* position of the first key in the dataset that is bigger than key,
+ * or n if there is none */
+int lookup_upper_bound(index_t *index, data_t key) {
+	return key == KEY_MAX
+		? index->n
+		: lookup_lower_bound(index, key_next(key));
+}
+
+/* number of keys between lo and hi, inclusive */
+int range_count(index_t *index, data_t lo, data_t hi) {
+	if (lo > hi) {
+		return 0;
+	}
+	return lookup_upper_bound(index, hi) - lookup_lower_bound(index, lo);
+}
+
+/* start iterating over the keys between lo and hi, inclusive */
+range_iter_t range_iter(index_t *index, data_t lo, data_t hi) {
+	range_iter_t it = {index->dataset, index->dataset};
+	if (lo <= hi) {
+		it.next += lookup_lower_bound(index, lo);
+		it.end += lookup_upper_bound(index, hi);
+	}
+	return it;
+}
+
+/* read the next key of a range query, returns 0 once it is done */
+int range_next(range_iter_t *it, data_t *key) {
+	if (it->next >= it->end) {
+		return 0;
+	}
+	*key = *it->next++;
+	return 1;
+}
+
+/****************************************************************/
+/* updatable index, with per-segment update buffers in the style of
+   the dynamic PGM-index and ALEX
+*/
+
+/* split the static index into segments that own their keys */
+void dyn_build(dyn_index_t *dyn, index_t *index, int seg) {
+	dyn->cap = max(index->mps_len, INIT_CAPACITY);
+	dyn->segs = (dyn_seg_t*)malloc(sizeof(*dyn->segs) * dyn->cap);
+	dyn->firsts = (data_t*)malloc(sizeof(*dyn->firsts) * dyn->cap);
+	assert(dyn->segs!=NULL && dyn->firsts!=NULL);
+	dyn->len = 0;
+	dyn->max_err = index->max_err;
+	dyn->seg = seg;
+	dyn->retrains = 0;
+
+	int start = 0;
+	for (int j = 0; j < index->mps_len && start < index->n; j++) {
+		int end = start;
+		while (end < index->n && index->dataset[end] <= index->mappings[j].max) {
+			end++;
+		}
+		if (end == start) {
+			continue;
+		}
+
+		/* the model predicted positions in the whole dataset */
+		dyn_seg_t *seg = &dyn->segs[dyn->len];
+		seg->len = end - start;
+		seg->keys = (data_t*)malloc(sizeof(*seg->keys) * seg->len);
+		assert(seg->keys!=NULL);
+		memcpy(seg->keys, index->dataset + start, sizeof(*seg->keys) * seg->len);
+		seg->model = index->mappings[j];
+		seg->model.a -= start;
+		data_arr_init(&seg->inserts, DELTA_MIN);
+		data_arr_init(&seg->deletes, DELTA_MIN);
+		dyn->firsts[dyn->len] = seg->keys[0];
+		dyn->len++;
+		start = end;
+	}
+}
+
+/* free the memory held by the updatable index */
+void dyn_free(dyn_index_t *dyn) {
+	for (int i = 0; i < dyn->len; i++) {
+		free(dyn->segs[i].keys);
+		data_arr_free(&dyn->segs[i].inserts);
+		data_arr_free(&dyn->segs[i].deletes);
+	}
+	free(dyn->segs);
+	free(dyn->firsts);
+}
+
+/* the last segment whose first key is not bigger than key, keys
+ * before the first segment go to it */
+int dyn_route(dyn_index_t *dyn, data_t key) {
+	int lo = 0, hi = dyn->len;
+	while (hi - lo > 1) {
+		int mid = (lo+hi)/2;
+		if (dyn->firsts[mid] <= key) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/* check if key is in the updatable index */
+int dyn_find(dyn_index_t *dyn, data_t key) {
+	dyn_seg_t *seg = &dyn->segs[dyn_route(dyn, key)];
+	if (buffer_count(&seg->inserts, key) > 0) {
+		return 1;
+	}
+	if (!dyn_base_find(seg, dyn->max_err, key)) {
+		return 0;
+	}
+
+	/* only count the duplicates when some of them were deleted */
+	int deleted = buffer_count(&seg->deletes, key);
+	return deleted == 0 || dyn_base_count(seg, key) > deleted;
+}
+
+/* insert one copy of key */
+void dyn_insert(dyn_index_t *dyn, data_t key) {
+	int s = dyn_route(dyn, key);
+	dyn_seg_t *seg = &dyn->segs[s];
+
+	/* an insert cancels an earlier delete of the same key */
+	if (!buffer_remove(&seg->deletes, key)) {
+		buffer_insert(&seg->inserts, key);
+	}
+	if (seg->inserts.len + seg->deletes.len > max(DELTA_MIN, seg->len / DELTA_RATIO)) {
+		dyn_retrain(dyn, s);
+	}
+}
+
+/* delete one copy of key, returns 0 if it was not there */
+int dyn_delete(dyn_index_t *dyn, data_t key) {
+	int s = dyn_route(dyn, key);
+	dyn_seg_t *seg = &dyn->segs[s];
+
+	if (!buffer_remove(&seg->inserts, key)) {
+		if (!dyn_base_find(seg, dyn->max_err, key)
+				|| dyn_base_count(seg, key) <= buffer_count(&seg->deletes, key)) {
+			return 0;
+		}
+		buffer_insert(&seg->deletes, key);
+	}
+	if (seg->inserts.len + seg->deletes.len > max(DELTA_MIN, seg->len / DELTA_RATIO)) {
+		dyn_retrain(dyn, s);
+	}
+	return 1;
+}
+
+/* apply the buffers of segment s and refit its keys. the segment is
+ * replaced by as many segments as the fit needs, so only its own keys
+ * are ever touched */
+void dyn_retrain(dyn_index_t *dyn, int s) {
+	data_arr_t merged;
+	data_arr_init(&merged, dyn->segs[s].len + dyn->segs[s].inserts.len);
+	dyn_merge(&dyn->segs[s], &merged);
+	dyn->retrains++;
+
+	map_arr_t models;
+	map_arr_init(&models, INIT_CAPACITY);
+	dyn_fit(dyn, merged.items, merged.len, &models);
+
+	/* a model whose keys were all taken by the one before it, as the
+	 * greedy engine makes on repeated keys, gives no segment */
+	int count = 0;
+	for (int i = 0, start = 0; i < models.len; i++) {
+		int end = start;
+		while (end < merged.len && merged.items[end] <= models.items[i].max) {
+			end++;
+		}
+		if (end > start) {
+			models.items[count++] = models.items[i];
+		}
+		start = end;
+	}
+
+	/* make room for the new segments, an empty segment is dropped
+	 * unless it is the only one */
+	if (count == 0 && dyn->len == 1) {
+		dyn_seg_t *seg = &dyn->segs[0];
+		seg->len = 0;
+		seg->inserts.len = seg->deletes.len = 0;
+		data_arr_free(&merged);
+		map_arr_free(&models);
+		return;
+	}
+	if (dyn->len + count - 1 > dyn->cap) {
+		dyn->cap = max(dyn->cap * 2, dyn->len + count - 1);
+		dyn->segs = (dyn_seg_t*)realloc(dyn->segs, sizeof(*dyn->segs) * dyn->cap);
+		dyn->firsts = (data_t*)realloc(dyn->firsts, sizeof(*dyn->firsts) * dyn->cap);
+		assert(dyn->segs!=NULL && dyn->firsts!=NULL);
+	}
+	data_t first = dyn->firsts[s];
+	free(dyn->segs[s].keys);
+	data_arr_free(&dyn->segs[s].inserts);
+	data_arr_free(&dyn->segs[s].deletes);
+	memmove(dyn->segs + s + count, dyn->segs + s + 1,
+		sizeof(*dyn->segs) * (dyn->len - s - 1));
+	memmove(dyn->firsts + s + count, dyn->firsts + s + 1,
+		sizeof(*dyn->firsts) * (dyn->len - s - 1));
+	dyn->len += count - 1;
+
+	/* each model becomes a segment owning the keys it covers */
+	int start = 0;
+	for (int i = 0; i < count; i++) {
+		int end = start;
+		while (end < merged.len && merged.items[end] <= models.items[i].max) {
+			end++;
+		}
+		dyn_seg_t *seg = &dyn->segs[s + i];
+		seg->len = end - start;
+		seg->keys = (data_t*)malloc(sizeof(*seg->keys) * seg->len);
+		assert(seg->keys!=NULL);
+		memcpy(seg->keys, merged.items + start, sizeof(*seg->keys) * seg->len);
+		seg->model = models.items[i];
+		seg->model.a -= start;
+		data_arr_init(&seg->inserts, DELTA_MIN);
+		data_arr_init(&seg->deletes, DELTA_MIN);
+		dyn->firsts[s + i] = i == 0 ? first : seg->keys[0];
+		start = end;
+	}
+
+	data_arr_free(&merged);
+	map_arr_free(&models);
+}
+
+/* segment keys with the engine the static index was built with. the
+ * greedy one needs three keys, fewer are left to the optimal one */
+void dyn_fit(dyn_index_t *dyn, data_t keys[], int n, map_arr_t *models) {
+	if (dyn->seg == SEG_GREEDY && n >= 3) {
+		build_greedy(keys, n, dyn->max_err, models);
+	} else if (n > 0) {
+		build_cone(keys, n, dyn->max_err, models);
+	}
+}
+
+/* merge the keys of a segment with its buffers, in sorted order */
+void dyn_merge(dyn_seg_t *seg, data_arr_t *out) {
+	int i = 0, j = 0, d = 0;
+	while (i < seg->len || j < seg->inserts.len) {
+		if (j == seg->inserts.len
+				|| (i < seg->len && seg->keys[i] <= seg->inserts.items[j])) {
+			/* each delete cancels one copy of the key */
+			while (d < seg->deletes.len && seg->deletes.items[d] < seg->keys[i]) {
+				d++;
+			}
+			if (d < seg->deletes.len && seg->deletes.items[d] == seg->keys[i]) {
+				d++;
+			} else {
+				data_arr_push(out, seg->keys[i]);
+			}
+			i++;
+		} else {
+			data_arr_push(out, seg->inserts.items[j++]);
+		}
+	}
+}
+
+/* check if key is among the trained keys of a segment, searching
+ * within max_err of the model's prediction */
+int dyn_base_find(dyn_seg_t *seg, int max_err, data_t key) {
+	if (seg->len == 0 || key < seg->keys[0] || key > seg->keys[seg->len - 1]) {
+		return 0;
+	}
+	int pos = predict_pos(key, &seg->model, 0, seg->len - 1);
+	int lo = max(0, pos - max_err);
+	int hi = min(seg->len - 1, pos + max_err) + 1;
+	int locn = lower_bound(seg->keys, lo, hi, key);
+	return locn < hi && seg->keys[locn] == key;
+}
+
+/* number of copies of key among the trained keys of a segment */
+int dyn_base_count(dyn_seg_t *seg, data_t key) {
+	return lower_bound(seg->keys, 0, seg->len, key == KEY_MAX ? key : key_next(key))
+		+ (key == KEY_MAX && seg->len > 0 && seg->keys[seg->len - 1] == key)
+		- lower_bound(seg->keys, 0, seg->len, key);
+}
+
+/* number of copies of key in a sorted buffer */
+int buffer_count(data_arr_t *buf, data_t key) {
+	int locn = lower_bound(buf->items, 0, buf->len, key);
+	int count = 0;
+	while (locn + count < buf->len && buf->items[locn + count] == key) {
+		count++;
+	}
+	return count;
+}
+
+/* insert a key into a sorted buffer */
+void buffer_insert(data_arr_t *buf, data_t key) {
+	int locn = lower_bound(buf->items, 0, buf->len, key);
+	data_arr_push(buf, key);
+	memmove(buf->items + locn + 1, buf->items + locn,
+		sizeof(*buf->items) * (buf->len - 1 - locn));
+	buf->items[locn] = key;
+}
+
+/* remove one copy of key from a sorted buffer, returns 0 if absent */
+int buffer_remove(data_arr_t *buf, data_t key) {
+	int locn = lower_bound(buf->items, 0, buf->len, key);
+	if (locn == buf->len || buf->items[locn] != key) {
+		return 0;
+	}
+	memmove(buf->items + locn, buf->items + locn + 1,
+		sizeof(*buf->items) * (buf->len - 1 - locn));
+	buf->len--;
+	return 1;
+}
+
+/* insert count random keys and delete half as many existing ones,
+ * check the result against a sorted copy and time a full rebuild */
+void bench_updates(index_t *index, int count, opts_t *opts) {
+	printf(BENCH_HEADER);
+
+	dyn_index_t dyn;
+	dyn_build(&dyn, index, opts->seg);
+	int segs_before = dyn.len;
+
+	data_t *inserts = (data_t*)malloc(sizeof(*inserts) * count);
+	data_t *deletes = (data_t*)malloc(sizeof(*deletes) * (count / 2 + 1));
+	assert(inserts!=NULL && deletes!=NULL);
+	unsigned long long state = 7;
+	data_t lo = index->dataset[0], hi = index->dataset[index->n - 1];
+	for (int i = 0; i < count; i++) {
+		inserts[i] = key_between(lo, hi, next_rand(&state));
+	}
+	for (int i = 0; i < count / 2; i++) {
+		deletes[i] = index->dataset[next_rand(&state) % index->n];
+	}
+
+	double start = now_sec();
+	for (int i = 0; i < count; i++) {
+		dyn_insert(&dyn, inserts[i]);
+	}
+	double insert_time = now_sec() - start;
+
+	start = now_sec();
+	int deleted = 0;
+	for (int i = 0; i < count / 2; i++) {
+		deleted += dyn_delete(&dyn, deletes[i]);
+	}
+	double delete_time = now_sec() - start;
+
+	/* the expected keys: dataset plus inserts, less what was deleted */
+	data_arr_t expect;
+	data_arr_init(&expect, index->n + count);
+	memcpy(expect.items, index->dataset, sizeof(*expect.items) * index->n);
+	memcpy(expect.items + index->n, inserts, sizeof(*expect.items) * count);
+	expect.len = index->n + count;
+	qsort(expect.items, expect.len, sizeof(*expect.items), cmp_data);
+	data_arr_t gone;
+	data_arr_init(&gone, count / 2 + 1);
+	for (int i = 0; i < count / 2; i++) {
+		buffer_insert(&gone, deletes[i]);
+	}
+	data_arr_t left;
+	data_arr_init(&left, expect.len);
+	for (int i = 0, d = 0; i < expect.len; i++) {
+		while (d < gone.len && gone.items[d] < expect.items[i]) {
+			d++;
+		}
+		if (d < gone.len && gone.items[d] == expect.items[i]) {
+			d++;
+		} else {
+			data_arr_push(&left, expect.items[i]);
+		}
+	}
+
+	/* every segment in order must give back exactly those keys */
+	data_arr_t got;
+	data_arr_init(&got, left.len);
+	for (int i = 0; i < dyn.len; i++) {
+		dyn_merge(&dyn.segs[i], &got);
+	}
+	int mismatches = got.len != left.len
+		|| memcmp(got.items, left.items, sizeof(*got.items) * got.len) != 0;
+	for (int i = 0; i < count; i++) {
+		data_t key = i % 2 == 0 ? inserts[i] : deletes[i / 2];
+		int expected = bsearch(&key, left.items, left.len, sizeof(key), cmp_data) != NULL;
+		mismatches += dyn_find(&dyn, key) != expected;
+	}
+
+	/* a full rebuild sorts and segments everything again, the way
+	 * stages 1 and 3 did. the input order is gone, so the keys that
+	 * are left are shuffled first */
+	memcpy(expect.items, left.items, sizeof(*expect.items) * left.len);
+	expect.len = left.len;
+	for (int i = expect.len - 1; i > 0; i--) {
+		int j = next_rand(&state) % (i + 1);
+		data_t key = expect.items[i];
+		expect.items[i] = expect.items[j];
+		expect.items[j] = key;
+	}
+	map_arr_t rebuilt;
+	map_arr_init(&rebuilt, INIT_CAPACITY);
+	start = now_sec();
+	sort_data(expect.items, expect.len, opts->sort, opts->threads);
+	dyn_fit(&dyn, expect.items, expect.len, &rebuilt);
+	double rebuild_time = now_sec() - start;
+
+	printf("Inserts: %d (%.2f Mkeys/s)\n", count, count / insert_time / 1e6);
+	printf("Deletes: %d of %d (%.2f Mkeys/s)\n", deleted, count / 2,
+		count / 2 / delete_time / 1e6);
+	printf("Segments: %d -> %d (%d retrains), %d mismatches\n",
+		segs_before, dyn.len, dyn.retrains, mismatches);
+	printf("Full rebuild: %.3f s, the time of %.0f inserts\n",
+		rebuild_time, rebuild_time * count / insert_time);
+	printf("\n");
+
+	free(inserts);
+	free(deletes);
+	data_arr_free(&expect);
+	data_arr_free(&gone);
+	data_arr_free(&left);
+	data_arr_free(&got);
+	map_arr_free(&rebuilt);
+	dyn_free(&dyn);
+}
+
+/* comparison function for qsort and bsearch */
+int cmp_data(const void *x1, const void *x2) {
+	return cmp((data_t*) x1, (data_t*) x2);
+}
+
+/****************************************************************/
+/* on-disk index */
+
+/* save the sorted dataset and the mapping table to path */
+void save_index(char *path, index_t *index) {
+	file_header_t header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, FILE_MAGIC, sizeof(header.magic));
+	header.version = FILE_VERSION;
+	header.endian = FILE_ENDIAN;
+	header.key_type = KEY_TYPE;
+	header.data_size = sizeof(data_t);
+	header.map_size = sizeof(map_t);
+	header.max_err = index->max_err;
+	header.n = index->n;
+	header.mps_len = index->mps_len;
+	header.data_offset = align_up(sizeof(header));
+	header.map_offset = align_up(header.data_offset + header.n * sizeof(data_t));
+	header.data_sum = checksum(index->dataset, header.n * sizeof(data_t));
+	header.map_sum = checksum(index->mappings, header.mps_len * sizeof(map_t));
+	header.header_sum = checksum(&header, offsetof(file_header_t, header_sum));
+
+	FILE *fp = fopen(path, "wb");
+	if (fp == NULL) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+
+	/* each section is padded with zeros up to its offset */
+	char pad[CACHE_LINE] = {0};
+	int ok = fwrite(&header, sizeof(header), 1, fp) == 1
+		&& fwrite(pad, header.data_offset - sizeof(header), 1, fp) == 1
+		&& fwrite(index->dataset, sizeof(data_t), header.n, fp) == header.n;
+	uint64_t gap = header.map_offset - header.data_offset - header.n * sizeof(data_t);
+	ok = ok && (gap == 0 || fwrite(pad, gap, 1, fp) == 1)
+		&& fwrite(index->mappings, sizeof(map_t), header.mps_len, fp) == header.mps_len;
+	if (fclose(fp) != 0 || !ok) {
+		fprintf(stderr, "%s: write failed\n", path);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* map an index saved by save_index into memory, the dataset and the
+ * mapping table are used in place. any file that does not match this
+ * build or fails its checksums is rejected */
+void load_index(char *path, index_t *index, mapped_t *file) {
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	if ((uint64_t) st.st_size < sizeof(file_header_t)) {
+		fprintf(stderr, "%s: not an index file\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	file->size = st.st_size;
+	file->addr = mmap(NULL, file->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (file->addr == MAP_FAILED) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+
+	file_header_t *header = (file_header_t*)file->addr;
+	char *base = (char*)file->addr;
+	uint64_t data_bytes = header->n * sizeof(data_t);
+	uint64_t map_bytes = header->mps_len * sizeof(map_t);
+	char *error = NULL;
+	if (memcmp(header->magic, FILE_MAGIC, sizeof(header->magic)) != 0) {
+		error = "not an index file";
+	} else if (header->header_sum
+			!= checksum(header, offsetof(file_header_t, header_sum))) {
+		error = "corrupt header";
+	} else if (header->version != FILE_VERSION || header->endian != FILE_ENDIAN
+			|| header->key_type != KEY_TYPE || header->data_size != sizeof(data_t)
+			|| header->map_size != sizeof(map_t)) {
+		error = "saved by an incompatible build";
+	} else if (header->n < 1 || header->n > INT_MAX
+			|| header->mps_len < 1 || header->mps_len > header->n
+			|| header->data_offset > file->size
+			|| data_bytes > file->size - header->data_offset
+			|| header->map_offset > file->size
+			|| map_bytes > file->size - header->map_offset) {
+		error = "truncated or corrupt layout";
+	} else if (header->data_sum != checksum(base + header->data_offset, data_bytes)
+			|| header->map_sum != checksum(base + header->map_offset, map_bytes)) {
+		error = "checksum mismatch";
+	}
+	if (error != NULL) {
+		fprintf(stderr, "%s: %s\n", path, error);
+		exit(EXIT_FAILURE);
+	}
+
+	index->dataset = (data_t*)(base + header->data_offset);
+	index->n = header->n;
+	index->mappings = (map_t*)(base + header->map_offset);
+	index->mps_len = header->mps_len;
+	index->max_err = header->max_err;
+}
+
+/* release a file mapped by load_index */
+void unmap_index(mapped_t *file) {
+	if (file->addr != NULL) {
+		munmap(file->addr, file->size);
+		file->addr = NULL;
+	}
+}
+
+/* 64-bit checksum of a buffer, hashing four words at a time in
+ * independent lanes so that it runs close to memory speed */
+uint64_t checksum(const void *buf, size_t len) {
+	const unsigned char *bytes = (const unsigned char*)buf;
+	uint64_t lanes[4] = {len, 1, 2, 3};
+	size_t i = 0;
+	for (; i + 32 <= len; i += 32) {
+		for (int l = 0; l < 4; l++) {
+			uint64_t word;
+			memcpy(&word, bytes + i + 8 * l, sizeof(word));
+			lanes[l] = (lanes[l] ^ word) * 0x9E3779B97F4A7C15ULL;
+			lanes[l] ^= lanes[l] >> 31;
+		}
+	}
+	uint64_t sum = 0;
+	for (int l = 0; l < 4; l++) {
+		sum = (sum ^ lanes[l]) * 0xFF51AFD7ED558CCDULL;
+	}
+	for (; i < len; i++) {
+		sum = (sum ^ bytes[i]) * 0x100000001B3ULL;
+	}
+	return sum ^ (sum >> 33);
+}
+
+/* round an offset up to the next cache line */
+uint64_t align_up(uint64_t offset) {
+	return (offset + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+}
+
+/****************************************************************/
+/* bulk input */
+
+/* set up standard input for read_key */
+void open_input(int format) {
+	input.format = format;
+	input.eof = 0;
+
+	struct stat st;
+	if (fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		input.size = st.st_size;
+		input.buf = mmap(NULL, input.size, PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0);
+		if (input.buf != MAP_FAILED) {
+			input.next = input.buf;
+			input.end = input.buf + input.size;
+			input.eof = 1;
+			return;
+		}
+	}
+
+	/* not a file that can be mapped, read it in blocks */
+	input.size = 0;
+	input.buf = (char*)malloc(INPUT_BLOCK + INPUT_TOKEN);
+	assert(input.buf != NULL);
+	input.next = input.end = input.buf;
+}
+
+/* release standard input */
+void close_input(void) {
+	if (input.size > 0) {
+		munmap(input.buf, input.size);
+	} else {
+		free(input.buf);
+	}
+	input.buf = NULL;
+}
+
+/* read the next key of the input, returns 1 on success and 0 at the
+ * end of the input or on anything that is not a key */
+int read_key(data_t *key) {
+	if (input.format == INPUT_BINARY) {
+		unsigned char b[sizeof(data_t)];
+		if (!read_bytes(b, sizeof(b))) {
+			return 0;
+		}
+#if defined(KEY_STRING)
+		/* the bytes of a string key are stored first byte first */
+		data_t value = 0;
+		for (int i = 0; i < KEY_WIDTH; i++) {
+			value = value << 8 | b[i];
+		}
+		*key = value;
+#else
+		uint64_t word = 0;
+		for (int i = sizeof(b) - 1; i >= 0; i--) {
+			word = word << 8 | b[i];
+		}
+		data_t value;
+		if (sizeof(data_t) == sizeof(uint32_t)) {
+			uint32_t half = word;
+			memcpy(&value, &half, sizeof(value));
+		} else {
+			memcpy(&value, &word, sizeof(value));
+		}
+		*key = value;
+#endif
+		return 1;
+	}
+
+	skip_space();
+
+#if defined(KEY_DOUBLE) || defined(KEY_STRING)
+	/* copy the token, with as much of it as a key can hold */
+	char token[KEY_CHARS + 1];
+	int len = 0;
+	while (1) {
+		while (input.next < input.end && !isspace((unsigned char) *input.next)) {
+			if (len < KEY_CHARS) {
+				token[len++] = *input.next;
+			}
+			input.next++;
+		}
+		if (input.next < input.end || !fill_input()) {
+			break;
+		}
+	}
+	token[len] = '\0';
+	if (len == 0) {
+		return 0;
+	}
+#if defined(KEY_DOUBLE)
+	char *rest;
+	*key = strtod(token, &rest);
+	if (*rest != '\0' || isnan(*key)) {
+		return 0;
+	}
+#else
+	data_t value = 0;
+	for (int i = 0; i < KEY_WIDTH; i++) {
+		value = value << 8 | (unsigned char) (i < len ? token[i] : 0);
+	}
+	*key = value;
+#endif
+	return 1;
+#else
+	long long value;
+	if (!parse_int(&value)) {
+		return 0;
+	}
+	if (value < KEY_MIN || value > KEY_MAX) {
+		fprintf(stderr, "input key out of range\n");
+		exit(EXIT_FAILURE);
+	}
+	*key = value;
+	return 1;
+#endif
+}
+
+/* read the next int of the input, which is a 32-bit little-endian
+ * integer in the binary format whatever the keys are */
+int read_int(int *value) {
+	if (input.format == INPUT_BINARY) {
+		unsigned char b[4];
+		if (!read_bytes(b, sizeof(b))) {
+			return 0;
+		}
+		uint32_t word = b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t) b[3] << 24);
+		int32_t signed_word;
+		memcpy(&signed_word, &word, sizeof(signed_word));
+		*value = signed_word;
+		return 1;
+	}
+
+	skip_space();
+	long long parsed;
+	if (!parse_int(&parsed)) {
+		return 0;
+	}
+	if (parsed < INT_MIN || parsed > INT_MAX) {
+		fprintf(stderr, "input integer out of range\n");
+		exit(EXIT_FAILURE);
+	}
+	*value = parsed;
+	return 1;
+}
+
+/* copy the next bytes of the binary input, returns 0 at its end */
+int read_bytes(unsigned char *out, int bytes) {
+	if (input.end - input.next < bytes) {
+		fill_input();
+	}
+	if (input.next == input.end) {
+		return 0;
+	}
+	if (input.end - input.next < bytes) {
+		fprintf(stderr, "binary input ends inside a value\n");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(out, input.next, bytes);
+	input.next += bytes;
+	return 1;
+}
+
+/* skip the white space before the next token of the text input, and
+ * make sure that a whole number is buffered after it */
+void skip_space(void) {
+	while (1) {
+		while (input.next < input.end && isspace((unsigned char) *input.next)) {
+			input.next++;
+		}
+		if (input.next < input.end || !fill_input()) {
+			break;
+		}
+	}
+	if (input.end - input.next < INPUT_TOKEN) {
+		fill_input();
+	}
+}
+
+/* move the unparsed bytes to the front of the read buffer and read
+ * more after them, returns 0 once there is nothing more to read */
+int fill_input(void) {
+	if (input.eof) {
+		return 0;
+	}
+	size_t left = input.end - input.next;
+	memmove(input.buf, input.next, left);
+	input.next = input.buf;
+	input.end = input.buf + left;
+
+	size_t got = fread(input.end, 1, INPUT_BLOCK + INPUT_TOKEN - left, stdin);
+	input.end += got;
+	if (got == 0) {
+		input.eof = 1;
+	}
+	return got > 0;
+}
+
+/* parse an optionally signed decimal integer at the start of the
+ * unparsed input. with SSE2 the digits are found with one 16-byte
+ * compare and converted without a loop, see digits_value */
+int parse_int(long long *value) {
+	char *p = input.next, *end = input.end;
+	int neg = 0;
+	if (p < end && (*p == '-' || *p == '+')) {
+		neg = *p == '-';
+		p++;
+	}
+	if (p == end || *p < '0' || *p > '9') {
+		return 0;
+	}
+
+	unsigned long long result = 0;
+
+#if defined(__SSE2__) && defined(__BYTE_ORDER__) \
+	&& __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	if (end - p >= 16) {
+		__m128i chunk = _mm_sub_epi8(_mm_loadu_si128((__m128i*) p),
+			_mm_set1_epi8('0'));
+		__m128i digit = _mm_and_si128(_mm_cmpgt_epi8(chunk, _mm_set1_epi8(-1)),
+			_mm_cmplt_epi8(chunk, _mm_set1_epi8(10)));
+		int len = __builtin_ctz(~_mm_movemask_epi8(digit));
+		if (len < 16) {
+			uint64_t lo, hi;
+			memcpy(&lo, p, sizeof(lo));
+			memcpy(&hi, p + 8, sizeof(hi));
+			result = len <= 8
+				? digits_value(lo, len)
+				: digits_value(lo, 8) * POW10[len - 8] + digits_value(hi, len - 8);
+			input.next = p + len;
+			*value = neg ? -(long long) result : (long long) result;
+			return 1;
+		}
+	}
+#endif
+
+	/* leading zeros could hide any number of digits, skip them */
+	while (p < end && *p == '0') {
+		p++;
+	}
+	char *first = p;
+	while (p < end && *p >= '0' && *p <= '9' && p - first < 19) {
+		result = result * 10 + (*p - '0');
+		p++;
+	}
+	input.next = p;
+
+	/* 19 digits fit an unsigned 64-bit integer, 20 may not */
+	if ((p < end && *p >= '0' && *p <= '9')
+			|| result > (unsigned long long) LLONG_MAX + neg) {
+		fprintf(stderr, "input integer out of range\n");
+		exit(EXIT_FAILURE);
+	}
+	*value = neg ? -(long long) (result - 1) - 1 : (long long) result;
+	return 1;
+}
+
+/* value of the first len (1 to 8) ASCII digits of a little-endian
+ * word. the digits are shifted to the top so that the bytes left
+ * over read as leading zeros, then paired up, then the pairs and the
+ * quads, with one multiply each */
+unsigned long long digits_value(uint64_t word, int len) {
+	word = (word - 0x3030303030303030ULL) << (8 * (8 - len));
+	word = (word * 10 + (word >> 8)) & 0x00FF00FF00FF00FFULL;
+	word = (word * 100 + (word >> 16)) & 0x0000FFFF0000FFFFULL;
+	return (word * 10000 + (word >> 32)) & 0xFFFFFFFFULL;
+}
+
+/****************************************************************/
+/* sort engines for stage 1 */
+
+/* sort n keys with the given engine, returns the engine used. auto
+ * leaves presorted input alone, quick sorts small inputs, sorts large
+ * ones in parallel when there are threads to spare and radix sorts
+ * the rest, which takes fewer passes the narrower the key range is */
+int sort_data(data_t items[], int n, int engine, int threads) {
+	if (engine == SORT_AUTO) {
+		if (is_sorted(items, n)) {
+			return SORT_PRESORTED;
+		}
+		engine = n < SORT_SMALL
+			? SORT_QUICK
+			: threads > 1 && n >= SORT_PARALLEL_MIN
+				? SORT_PARALLEL
+				: SORT_RADIX;
+	}
+
+	if (engine == SORT_QUICK) {
+		quick_sort(items, n);
+	} else if (engine == SORT_RADIX) {
+		data_t *tmp = (data_t*)malloc(max(n, 1) * sizeof(data_t));
+		assert(tmp != NULL);
+		radix_sort(items, n, tmp);
+		free(tmp);
+	} else {
+		parallel_sort(items, n, threads);
+	}
+	return engine;
+}
+
+/* check whether n keys are already in order */
+int is_sorted(data_t items[], int n) {
+	for (int i = 1; i < n; i++) {
+		if (items[i - 1] > items[i]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* LSD radix sort of n keys with tmp as scratch space. the keys are
+ * sorted by their key_bits offset by the smallest one, so that only
+ * the digits that vary across the key range are passed over */
+void radix_sort(data_t items[], int n, data_t tmp[]) {
+	if (n < 2) {
+		return;
+	}
+
+	uint64_t lo = key_bits(items[0]), hi = lo;
+	for (int i = 1; i < n; i++) {
+		uint64_t bits = key_bits(items[i]);
+		lo = bits < lo ? bits : lo;
+		hi = bits > hi ? bits : hi;
+	}
+	uint64_t range = hi - lo;
+
+	data_t *src = items, *dst = tmp;
+	int count[RADIX_SIZE];
+	for (int shift = 0; shift < (int) sizeof(data_t) * CHAR_BIT
+			&& (range >> shift) != 0; shift += RADIX_BITS) {
+		memset(count, 0, sizeof(count));
+		for (int i = 0; i < n; i++) {
+			count[((key_bits(src[i]) - lo) >> shift) & (RADIX_SIZE - 1)]++;
+		}
+
+		/* a digit shared by all the keys leaves them in place */
+		if (count[((key_bits(src[0]) - lo) >> shift) & (RADIX_SIZE - 1)] == n) {
+			continue;
+		}
+
+		/* turn the counts into the first slot of each digit */
+		int sum = 0;
+		for (int d = 0; d < RADIX_SIZE; d++) {
+			int c = count[d];
+			count[d] = sum;
+			sum += c;
+		}
+		for (int i = 0; i < n; i++) {
+			dst[count[((key_bits(src[i]) - lo) >> shift) & (RADIX_SIZE - 1)]++] = src[i];
+		}
+
+		data_t *t = src;
+		src = dst;
+		dst = t;
+	}
+
+	if (src != items) {
+		memcpy(items, src, n * sizeof(data_t));
+	}
+}
+
+/* parallel sample sort: every thread radix sorts one run of the input,
+ * splitters sampled from the sorted runs cut each run into a bucket per
+ * thread, and every thread then merges its bucket out of all the runs
+ * straight into its place in the output */
+void parallel_sort(data_t items[], int n, int threads) {
+	threads = max(1, min(threads, n / SAMPLE_RATE));
+	data_t *tmp = (data_t*)malloc(max(n, 1) * sizeof(data_t));
+	int *cuts = (int*)malloc(threads * (threads + 1) * sizeof(int));
+	sort_task_t *tasks = (sort_task_t*)malloc(threads * sizeof(sort_task_t));
+	data_t *samples = (data_t*)malloc(threads * SAMPLE_RATE * sizeof(data_t));
+	assert(tmp != NULL && cuts != NULL && tasks != NULL && samples != NULL);
+
+	/* phase 1: sort the runs */
+	for (int t = 0; t < threads; t++) {
+		sort_task_t task = {items, tmp, (long long) n * t / threads,
+			(long long) n * (t + 1) / threads, threads, cuts, t, 0};
+		tasks[t] = task;
+	}
+	run_threads(sort_run, tasks, threads);
+
+	/* pick threads - 1 splitters from evenly spaced samples of the runs */
+	for (int t = 0; t < threads; t++) {
+		int len = tasks[t].hi - tasks[t].lo;
+		for (int s = 0; s < SAMPLE_RATE; s++) {
+			samples[t * SAMPLE_RATE + s] = items[tasks[t].lo
+				+ (int) ((long long) len * s / SAMPLE_RATE)];
+		}
+	}
+	quick_sort(samples, threads * SAMPLE_RATE);
+
+	/* cut every run at the splitters, equal keys share a bucket */
+	for (int r = 0; r < threads; r++) {
+		int *cut = cuts + r * (threads + 1);
+		cut[0] = tasks[r].lo;
+		cut[threads] = tasks[r].hi;
+		for (int b = 1; b < threads; b++) {
+			cut[b] = lower_bound(items, cut[b - 1], tasks[r].hi,
+				samples[b * SAMPLE_RATE]);
+		}
+	}
+
+	/* phase 2: merge the buckets */
+	int out = 0;
+	for (int b = 0; b < threads; b++) {
+		tasks[b].out = out;
+		for (int r = 0; r < threads; r++) {
+			out += cuts[r * (threads + 1) + b + 1] - cuts[r * (threads + 1) + b];
+		}
+	}
+	run_threads(merge_bucket, tasks, threads);
+	memcpy(items, tmp, n * sizeof(data_t));
+
+	free(tmp);
+	free(cuts);
+	free(tasks);
+	free(samples);
+}
+
+/* first phase of the parallel sort: radix sort one run in place */
+void *sort_run(void *arg) {
+	sort_task_t *task = (sort_task_t*)arg;
+	radix_sort(task->items + task->lo, task->hi - task->lo, task->tmp + task->lo);
+	return NULL;
+}
+
+/* second phase of the parallel sort: merge one bucket out of every run
+ * into its place in tmp */
+void *merge_bucket(void *arg) {
+	sort_task_t *task = (sort_task_t*)arg;
+	int runs = task->threads, b = task->bucket;
+	int heads[MAX_THREADS], ends[MAX_THREADS];
+	for (int r = 0; r < runs; r++) {
+		heads[r] = task->cuts[r * (runs + 1) + b];
+		ends[r] = task->cuts[r * (runs + 1) + b + 1];
+	}
+
+	/* take the smallest head until the runs are drained */
+	int out = task->out;
+	while (1) {
+		int best = -1;
+		for (int r = 0; r < runs; r++) {
+			if (heads[r] < ends[r] && (best < 0
+					|| task->items[heads[r]] < task->items[heads[best]])) {
+				best = r;
+			}
+		}
+		if (best < 0) {
+			break;
+		}
+		task->tmp[out++] = task->items[heads[best]++];
+	}
+	return NULL;
+}
+
+/* run fn over the tasks, one thread each, and wait for all of them */
+void run_threads(void *(*fn)(void*), sort_task_t tasks[], int threads) {
+	pthread_t ids[MAX_THREADS];
+	for (int t = 1; t < threads; t++) {
+		if (pthread_create(&ids[t], NULL, fn, &tasks[t]) != 0) {
+			fprintf(stderr, "cannot start sort thread\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	fn(&tasks[0]);
+	for (int t = 1; t < threads; t++) {
+		pthread_join(ids[t], NULL);
+	}
+}
+
+/****************************************************************/
+/* concurrent query serving */
+
+/* start threads - 1 workers, the calling thread is the last one */
+void pool_start(pool_t *pool, index_t *index, int threads) {
+	pool->index = index;
+	pool->threads = max(1, min(threads, MAX_THREADS));
+	pool->round = pool->busy = pool->stop = 0;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->go, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	for (int t = 1; t < pool->threads; t++) {
+		worker_t *worker = &pool->workers[t];
+		worker->pool = pool;
+		worker->id = t;
+		if (pthread_create(&worker->thread, NULL, pool_worker, worker) != 0) {
+			fprintf(stderr, "cannot start query thread\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/* answer a batch of queries with every worker of the pool, out[i]
+ * is the position of keys[i] or BS_NOT_FOUND */
+void pool_run(pool_t *pool, data_t keys[], int count, int out[], int pipe) {
+	pthread_mutex_lock(&pool->lock);
+	pool->keys = keys;
+	pool->count = count;
+	pool->out = out;
+	pool->pipe = pipe;
+	pool->busy = pool->threads - 1;
+	pool->round++;
+	pthread_cond_broadcast(&pool->go);
+	pthread_mutex_unlock(&pool->lock);
+
+	pool_share(pool, 0);
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->busy > 0) {
+		pthread_cond_wait(&pool->done, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* stop the workers and wait for them to exit */
+void pool_stop(pool_t *pool) {
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->go);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (int t = 1; t < pool->threads; t++) {
+		pthread_join(pool->workers[t].thread, NULL);
+	}
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->go);
+	pthread_cond_destroy(&pool->done);
+}
+
+/* wait for batches and answer a share of each until stopped */
+void *pool_worker(void *arg) {
+	worker_t *worker = (worker_t*)arg;
+	pool_t *pool = worker->pool;
+	int seen = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		while (pool->round == seen && !pool->stop) {
+			pthread_cond_wait(&pool->go, &pool->lock);
+		}
+		if (pool->stop) {
+			break;
+		}
+		seen = pool->round;
+		pthread_mutex_unlock(&pool->lock);
+
+		pool_share(pool, worker->id);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->busy == 0) {
+			pthread_cond_signal(&pool->done);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+	STAT(stats_merge();)
+	return NULL;
+}
+
+/* answer the share of the current batch that belongs to worker id */
+void pool_share(pool_t *pool, int id) {
+	int lo = (long long) pool->count * id / pool->threads;
+	int hi = (long long) pool->count * (id + 1) / pool->threads;
+	if (pool->pipe) {
+		lookup_pipelined(pool->index, pool->keys + lo, hi - lo, pool->out + lo);
+	} else {
+		lookup_batch(pool->index, pool->keys + lo, hi - lo, pool->out + lo);
+	}
+}
+
+/****************************************************************/
+/* synthetic workloads */
+
+/* parse the name of a key distribution, returns 0 if it is unknown */
+int parse_dist(char *name, int *dist) {
+	char *names[] = {"uniform", "normal", "lognormal", "zipf", "cluster",
+		"time", "all"};
+	for (int i = 0; i < (int) (sizeof(names) / sizeof(*names)); i++) {
+		if (strcmp(name, names[i]) == 0) {
+			*dist = i;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* benchmark the chosen distributions on datasets of 1000, 10000, ...
+ * keys up to opts->n, which is benchmarked as well */
+void run_workloads(opts_t *opts) {
+	printf(WORKLOAD_HEADER);
+
+	data_t *keys = (data_t*)malloc(sizeof(*keys) * opts->n);
+	assert(keys!=NULL);
+
+	int first = opts->workload == DIST_ALL ? 0 : opts->workload;
+	int last = opts->workload == DIST_ALL ? DIST_ALL - 1 : opts->workload;
+	for (int dist = first; dist <= last; dist++) {
+		int n = min(WORKLOAD_MIN, opts->n);
+		while (1) {
+			run_workload(dist, keys, n, opts);
+			if (n == opts->n) {
+				break;
+			}
+			n = n > opts->n / 10 ? opts->n : n * 10;
+		}
+	}
+
+	free(keys);
+}
+
+/* generate n keys, build the index over them and time the learned
+ * index against the two binary search baselines on hits and misses */
+void run_workload(int dist, data_t keys[], int n, opts_t *opts) {
+	char *names[] = {"uniform", "normal", "lognormal", "zipf", "cluster", "time"};
+	char *methods[] = {"learned", "search_key", "lower_bound"};
+	int count = opts->bench > 0 ? opts->bench : WORKLOAD_QUERIES;
+
+	generate_keys(dist, keys, n, 42 + dist);
+	double start = now_sec();
+	sort_data(keys, n, opts->sort, opts->threads);
+	double sort_time = now_sec() - start;
+
+	/* build the index the way stage 3 does, without printing */
+	map_arr_t mappings;
+	level_arr_t levels = {NULL, 0, 0};
+	map_arr_init(&mappings, INIT_CAPACITY);
+	start = now_sec();
+	if (opts->seg == SEG_CONE) {
+		build_cone(keys, n, opts->err, &mappings);
+	} else {
+		build_greedy(keys, n, opts->err, &mappings);
+	}
+	if (opts->rmi) {
+		build_levels(mappings.items, mappings.len, &levels);
+	}
+	double build_time = now_sec() - start;
+	index_t index = {keys, n, mappings.items, mappings.len, opts->err, &levels, NULL};
+
+	printf("%s, %d keys: sort %.3f s, build %.3f s, %d functions, "
+		"%lld index bytes\n", names[dist], n, sort_time, build_time,
+		mappings.len, index_bytes(&index));
+
+	data_t *hits = (data_t*)malloc(sizeof(*hits) * count);
+	data_t *misses = (data_t*)malloc(sizeof(*misses) * count);
+	double *lat = (double*)malloc(sizeof(*lat) * count);
+	assert(hits!=NULL && misses!=NULL && lat!=NULL);
+	int miss_count = draw_queries(keys, n, hits, misses, count);
+
+	/* every method must find all hits and none of the misses */
+	int mismatches = 0;
+	for (int method = 0; method < 3; method++) {
+		for (int i = 0; i < count; i++) {
+			int found = workload_lookup(&index, method, hits[i]);
+			mismatches += found == BS_NOT_FOUND || keys[found] != hits[i];
+		}
+		for (int i = 0; i < miss_count; i++) {
+			mismatches += workload_lookup(&index, method, misses[i]) != BS_NOT_FOUND;
+		}
+	}
+
+	for (int method = 0; method < 3; method++) {
+		for (int miss = 0; miss < 2; miss++) {
+			int len = miss ? miss_count : count;
+			if (len == 0) {
+				continue;
+			}
+			time_queries(&index, method, miss ? misses : hits, len, lat);
+			qsort(lat, len, sizeof(*lat), cmp_double);
+			printf("  %-11s %6s: p50 %6.0f ns, p90 %6.0f ns, p99 %6.0f ns, "
+				"p99.9 %6.0f ns\n", methods[method], miss ? "misses" : "hits",
+				lat[(int) (0.5 * (len - 1))], lat[(int) (0.9 * (len - 1))],
+				lat[(int) (0.99 * (len - 1))], lat[(int) (0.999 * (len - 1))]);
+		}
+	}
+	printf("  %d queries, %d mismatches\n\n", count, mismatches);
+
+	free(hits);
+	free(misses);
+	free(lat);
+	map_arr_free(&mappings);
+	free_levels(&levels);
+}
+
+/* fill keys with n keys of a distribution, reproducible from seed:
+ *   uniform     uniform over the key range
+ *   normal      mean in the middle of the range, deviation a tenth
+ *   lognormal   exp of a normal with deviation 2, cut at 5 deviations
+ *   zipf        ranks 1 to n with frequency 1/rank, so small keys
+ *               repeat many times
+ *   cluster     WORKLOAD_CLUSTERS narrow normals around random
+ *               centres, shaped like locations or allocated ids
+ *   time        arrival timestamps whose rate rises and falls over
+ *               WORKLOAD_DAYS cycles, generated already sorted */
+void generate_keys(int dist, data_t keys[], int n, unsigned long long seed) {
+	unsigned long long state = seed * 2654435761ULL + 1;
+	double centres[WORKLOAD_CLUSTERS];
+	for (int c = 0; c < WORKLOAD_CLUSTERS; c++) {
+		centres[c] = next_unit(&state);
+	}
+
+	double t = 0;
+	for (int i = 0; i < n; i++) {
+		double x = 0;
+		if (dist == DIST_UNIFORM) {
+			x = next_unit(&state);
+		} else if (dist == DIST_NORMAL) {
+			x = 0.5 + 0.1 * next_normal(&state);
+		} else if (dist == DIST_LOGNORMAL) {
+			x = exp(2 * next_normal(&state) - 10);
+		} else if (dist == DIST_ZIPF) {
+			/* inverse of the continuous cumulative frequency */
+			x = (floor(pow(n + 1.0, next_unit(&state))) - 1) / n;
+		} else if (dist == DIST_CLUSTER) {
+			x = centres[next_rand(&state) % WORKLOAD_CLUSTERS]
+				+ 0.002 * next_normal(&state);
+		} else {
+			/* the rate averages to one arrival per unit of time */
+			double rate = 1 + 0.9 * sin(2 * PI * WORKLOAD_DAYS * t / n);
+			t += -log(1 - next_unit(&state)) / rate;
+			x = t / (2.0 * n);
+		}
+		keys[i] = key_from_unit(fmin(1, fmax(0, x)));
+	}
+}
+
+/* uniform random number in [0, 1) */
+double next_unit(unsigned long long *state) {
+	return (next_rand(state) >> 11) * 0x1.0p-53;
+}
+
+/* standard normal random number, by the Box-Muller transform */
+double next_normal(unsigned long long *state) {
+	double u = 1 - next_unit(state);
+	return sqrt(-2 * log(u)) * cos(2 * PI * next_unit(state));
+}
+
+/* map x in [0, 1] onto the non-negative keys, in the same order */
+data_t key_from_unit(double x) {
+#if defined(KEY_DOUBLE)
+	return x * 1e9;
+#elif defined(KEY_INT32)
+	return (data_t) (x * KEY_MAX);
+#else
+	return (data_t) (x * 0x1.0p62);
+#endif
+}
+
+/* draw count keys of the dataset and up to count keys in its range that
+ * are not in it, and return how many of the latter were drawn. a miss
+ * that is not found in WORKLOAD_TRIES tries is taken just outside the
+ * keys, and skipped if they span the whole key range */
+int draw_queries(data_t dataset[], int n, data_t hits[], data_t misses[], int count) {
+	unsigned long long state = 7;
+	data_t lo = dataset[0], hi = dataset[n - 1];
+	int drawn = 0;
+	for (int i = 0; i < count; i++) {
+		hits[i] = dataset[next_rand(&state) % n];
+		int found = 0;
+		for (int try = 0; try < WORKLOAD_TRIES && !found; try++) {
+			data_t key = key_between(lo, hi, next_rand(&state));
+			int pos = lower_bound_std(dataset, n, key);
+			if (pos == n || dataset[pos] != key) {
+				misses[drawn++] = key;
+				found = 1;
+			}
+		}
+		if (!found && hi != KEY_MAX) {
+			misses[drawn++] = key_next(hi);
+		} else if (!found && lo != KEY_MIN) {
+			misses[drawn++] = key_prev(lo);
+		}
+	}
+	return drawn;
+}
+
+/* time each lookup on its own, lat[i] is the latency of keys[i] in
+ * nanoseconds without the cost of reading the clock */
+void time_queries(index_t *index, int method, data_t keys[], int count, double lat[]) {
+	long long overhead = LLONG_MAX;
+	for (int i = 0; i < 1000; i++) {
+		long long start = now_ns();
+		overhead = fmin(overhead, now_ns() - start);
+	}
+
+	volatile unsigned sink = 0;
+	for (int i = 0; i < count; i++) {
+		long long start = now_ns();
+		sink += (unsigned) workload_lookup(index, method, keys[i]);
+		lat[i] = fmax(0, now_ns() - start - overhead);
+	}
+	(void) sink;
+}
+
+/* position of key with the learned index or one of the baselines, or
+ * BS_NOT_FOUND */
+int workload_lookup(index_t *index, int method, data_t key) {
+	if (method == 0) {
+		return lookup_scalar(index, key);
+	} else if (method == 1) {
+		return find_key(index->dataset, index->n, key);
+	}
+	int pos = lower_bound_std(index->dataset, index->n, key);
+	return pos < index->n && index->dataset[pos] == key ? pos : BS_NOT_FOUND;
+}
+
+/* search_key over the whole dataset without the printing, the binary
+ * search the learned index replaces */
+int find_key(data_t dataset[], int n, data_t key) {
+	int lo = 0, hi = n;
+	while (lo < hi) {
+		int mid = (lo+hi)/2;
+		int outcome = cmp(&key, dataset + mid);
+		if (outcome < 0) {
+			hi = mid;
+		} else if (outcome > 0) {
+			lo = mid+1;
+		} else {
+			return mid;
+		}
+	}
+	return BS_NOT_FOUND;
+}
+
+/* position of the first key not smaller than key, the loop of
+ * std::lower_bound in libstdc++ */
+int lower_bound_std(data_t keys[], int n, data_t key) {
+	int first = 0, len = n;
+	while (len > 0) {
+		int half = len / 2;
+		if (keys[first + half] < key) {
+			first += half + 1;
+			len -= half + 1;
+		} else {
+			len = half;
+		}
+	}
+	return first;
+}
+
+/* memory held by the mappings and the recursive model layer, the
+ * dataset itself is not counted */
+long long index_bytes(index_t *index) {
+	long long bytes = (long long) sizeof(map_t) * index->mps_len;
+	for (int i = 0; i < index->levels->len; i++) {
+		level_t *level = &index->levels->items[i];
+		bytes += (long long) sizeof(data_t) * level->len;
+		bytes += (long long) (sizeof(map_t) + sizeof(int)) * level->models.len;
+	}
+	return bytes;
+}
+
+/* monotonic clock in nanoseconds, fine enough to time one lookup */
+long long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* compare two doubles for qsort */
+int cmp_double(const void *x1, const void *x2) {
+	double a = *(const double*)x1, b = *(const double*)x2;
+	return (a > b) - (a < b);
+}
+
+/****************************************************************/
+/* max_err auto-tuning */
+
+/* a small max_err makes many mappings and a deep Step 2 search, a big
+ * one a wide Step 3 window. build the index for max_err = 1, 2, 4, ...
+ * until a single mapping is left, time the lookups chosen by the
+ * options on a sample of hits and misses, and return the fastest
+ * max_err whose mappings and model levels fit in opts->tune bytes */
+int tune_max_err(data_t dataset[], int n, opts_t *opts) {
+	int count = min(TUNE_QUERIES, 2 * n);
+	data_t *keys = (data_t*)malloc(sizeof(*keys) * count);
+	int *out = (int*)malloc(sizeof(*out) * count);
+	assert(keys!=NULL && out!=NULL);
+	int half = count / 2;
+	count = half + draw_queries(dataset, n, keys, keys + half, half);
+
+	int best = -1, last = 0;
+	double best_time = 0;
+	for (int err = 1; !last; err = err > INT_MAX / 2 ? INT_MAX : err * 2) {
+		map_arr_t mappings;
+		level_arr_t levels = {NULL, 0, 0};
+		map_arr_init(&mappings, INIT_CAPACITY);
+		if (opts->seg == SEG_CONE) {
+			build_cone(dataset, n, err, &mappings);
+		} else {
+			build_greedy(dataset, n, err, &mappings);
+		}
+		if (opts->rmi) {
+			build_levels(mappings.items, mappings.len, &levels);
+		}
+		index_t index = {dataset, n, mappings.items, mappings.len, err, &levels, NULL};
+		last = mappings.len == 1 || err == INT_MAX;
+
+		long long bytes = index_bytes(&index);
+		double time = time_lookups(&index, keys, count, out, opts);
+		printf("Tuning max_err %9d: %7d functions, %9lld bytes, %7.1f ns per "
+			"lookup%s\n", err, mappings.len, bytes, time * 1e9 / count,
+			bytes > opts->tune ? ", too big" : "");
+		if (bytes <= opts->tune && (best < 0 || time < best_time)) {
+			best = err;
+			best_time = time;
+		}
+
+		map_arr_free(&mappings);
+		free_levels(&levels);
+	}
+
+	if (best < 0) {
+		fprintf(stderr, "no segment table fits in %lld bytes\n", opts->tune);
+		exit(EXIT_FAILURE);
+	}
+
+	/* the timed lookups are not part of the statistics */
+	STAT(memset(&stats, 0, sizeof(stats));)
+	free(keys);
+	free(out);
+	return best;
+}
+
+/* the best of TUNE_ROUNDS timings of the lookups of count keys, with
+ * the stage 4 lookups the options choose */
+double time_lookups(index_t *index, data_t keys[], int count, int *out, opts_t *opts) {
+	double best = 0;
+	for (int round = 0; round < TUNE_ROUNDS; round++) {
+		double start = now_sec();
+		if (opts->pipe) {
+			lookup_pipelined(index, keys, count, out);
+		} else if (opts->batch) {
+			lookup_batch(index, keys, count, out);
+		} else {
+			for (int i = 0; i < count; i++) {
+				out[i] = lookup_scalar(index, keys[i]);
+			}
+		}
+		double time = now_sec() - start;
+		best = round == 0 || time < best ? time : best;
+	}
+	return best;
+}
+
+/****************************************************************/
+/* lookup statistics */
+
+/* print a key compared by the stage 4 searches */
+void trace_probe(data_t key) {
+	printf(" %s", key_str(key));
+	STAT(stats.traced++;)
+}
+
+/* number of keys a branchless search of len keys compares, which only
+ * depends on len: one per halving down to scan keys, then the scan.
+ * lower_bound scans SCAN_MAX keys, the mapping searches scan one */
+int search_probes(int len, int scan) {
+	int probes = 0;
+	while (len > scan) {
+		len -= len / 2;
+		probes++;
+	}
+	return probes + len;
+}
+
+/* count a finished lookup of p2 + p3 probes, predicted at pred and
+ * found at pos or BS_NOT_FOUND */
+void stats_lookup(int p2, int p3, int pred, int pos, int max_err) {
+#if defined(STATS)
+	stats.lookups++;
+	stats.step2 += p2;
+	stats.step3 += p3;
+	stats.probes[stats_bin(p2 + p3)]++;
+	if (pos != BS_NOT_FOUND) {
+		int err = abs(pred - pos);
+		stats.found++;
+		stats.errors[stats_bin(err)]++;
+		stats.over += err > max_err;
+	}
+#else
+	(void) p2, (void) p3, (void) pred, (void) pos, (void) max_err;
+#endif
+}
+
+/* add the counters of this thread to the total and clear them */
+void stats_merge(void) {
+#if defined(STATS)
+	pthread_mutex_lock(&stats_lock);
+	stats_total.lookups += stats.lookups;
+	stats_total.found += stats.found;
+	stats_total.step2 += stats.step2;
+	stats_total.step3 += stats.step3;
+	stats_total.over += stats.over;
+	for (int b = 0; b < STATS_BINS; b++) {
+		stats_total.probes[b] += stats.probes[b];
+		stats_total.errors[b] += stats.errors[b];
+	}
+	pthread_mutex_unlock(&stats_lock);
+	memset(&stats, 0, sizeof(stats));
+#endif
+}
+
+/* print the counters of all threads as one name and value per line,
+ * histograms as upper bound:count pairs, then the segments of the
+ * index unless it is NULL */
+void stats_dump(index_t *index) {
+#if defined(STATS)
+	stats_merge();
+	printf(STATS_HEADER);
+	printf("lookups %lld\n", stats_total.lookups);
+	printf("found %lld\n", stats_total.found);
+	printf("step2_probes %lld\n", stats_total.step2);
+	printf("step3_probes %lld\n", stats_total.step3);
+	print_bins("probes", stats_total.probes);
+	print_bins("errors", stats_total.errors);
+	printf("errors_over_max_err %lld\n", stats_total.over);
+
+	if (index != NULL) {
+		/* keys covered by each mapping, up to and including its max */
+		long long sizes[STATS_BINS] = {0};
+		int smallest = index->n, biggest = 0;
+		for (int i = 0, k = 0; i < index->mps_len; i++) {
+			int first = k;
+			while (k < index->n && (i == index->mps_len - 1
+					|| index->dataset[k] <= index->mappings[i].max)) {
+				k++;
+			}
+			sizes[stats_bin(k - first)]++;
+			smallest = min(smallest, k - first);
+			biggest = max(biggest, k - first);
+		}
+		printf("max_err %d\n", index->max_err);
+		printf("segments %d\n", index->mps_len);
+		printf("segment_keys_min %d\n", smallest);
+		printf("segment_keys_max %d\n", biggest);
+		print_bins("segment_keys", sizes);
+		printf("segment_search_depth %d\n", index->levels->len > 0
+			? index->levels->len : search_depth(index->mps_len));
+	}
+	printf("\n");
+#else
+	(void) index;
+#endif
+}
+
+/* histogram bucket of a value: 0, then 1, 2-3, 4-7, ... */
+int stats_bin(long long value) {
+	int bin = value > 0 ? 64 - __builtin_clzll(value) : 0;
+	return min(bin, STATS_BINS - 1);
+}
+
+/* print the non-empty buckets of a histogram on one line */
+void print_bins(char *name, long long bins[]) {
+	printf("%s", name);
+	for (int b = 0; b < STATS_BINS; b++) {
+		if (bins[b] > 0) {
+			printf(" %lld:%lld", b == 0 ? 0 : (1LL << b) - 1, bins[b]);
+		}
+	}
+	printf("\n");
+}
+
+/****************************************************************/
+/* functions provided, adapt them as appropriate */
+
+/* print stage header given stage number */
+void print_stage_header(int stage_num) {
+	printf(STAGE_HEADER, stage_num);
+}
 
 /* data swap function used by quick sort, adpated from
    https://people.eng.unimelb.edu.au/ammoffat/ppsaa/c/sortscaffold.c
@@ -322,25 +4124,35 @@ void partition(data_t dataset[], int n, data_t *pivot, int *first_eq, int *first
 
 /* quick sort function, adapted from
    https://people.eng.unimelb.edu.au/ammoffat/ppsaa/c/quicksort.c 
+
+   only the smaller section is sorted recursively and the larger one
+   is handled by the loop, so the recursion depth stays O(log n)
+   even for very large datasets
 */
 void quick_sort(data_t dataset[], int n) {
 	data_t pivot;
 	int first_eq, first_gt;
-	if (n<=1) {
-		return;
+	while (n>1) {
+		/* array section is non-trivial */
+		pivot = dataset[n/2]; // take the middle element as the pivot
+		partition(dataset, n, &pivot, &first_eq, &first_gt);
+		if (first_eq < n - first_gt) {
+			quick_sort(dataset, first_eq);
+			dataset += first_gt;
+			n -= first_gt;
+		} else {
+			quick_sort(dataset + first_gt, n - first_gt);
+			n = first_eq;
+		}
 	}
-	/* array section is non-trivial */
-	pivot = dataset[n/2]; // take the middle element as the pivot
-	partition(dataset, n, &pivot, &first_eq, &first_gt);
-	quick_sort(dataset, first_eq);
-	quick_sort(dataset + first_gt, n - first_gt);
 }
 
 /* comparison function used by binary search and quick sort, from
    https://people.eng.unimelb.edu.au/ammoffat/ppsaa/c/binarysearch.c 
 */
 int cmp(data_t *x1, data_t *x2) {
-	return (*x1-*x2);
+	/* compare rather than subtract, so that keys far apart cannot overflow */
+	return (*x1 > *x2) - (*x1 < *x2);
 }
 
 /* binary search between dataset[lo] and dataset[hi-1], adapted from
@@ -360,7 +4172,7 @@ int search_mappings(map_t mappings[], int lo, int hi, data_t *key, int *locn) {
 	}
 
 	/* print the value that key is being compared to */
-	printf(" %d", mappings[mid].max);
+	trace_probe(mappings[mid].max);
 	
 	if ((outcome = cmp(key, &(mappings+mid)->max)) < 0) {
 		return search_mappings(mappings, lo, mid, key, locn);
@@ -382,7 +4194,7 @@ int search_key(data_t dataset[], int lo, int hi, data_t *key, int *locn) {
 	}
 
 	/* print the value that key is being compared to */
-	printf(" %d", dataset[mid]);
+	trace_probe(dataset[mid]);
 	
 	if ((outcome = cmp(key, dataset+mid)) < 0) {
 		return search_key(dataset, lo, mid, key, locn);
@@ -393,3 +4205,23 @@ int search_key(data_t dataset[], int lo, int hi, data_t *key, int *locn) {
 		return BS_FOUND;
 	}
 }
+
+/* binary search adapted to find the first key in a model level
+ * that is not smaller than key */
+int search_level(data_t keys[], int lo, int hi, data_t *key, int *locn) {
+	int mid = (lo+hi)/2, outcome;
+
+	if (lo>=hi) {
+		*locn = mid;
+		return BS_FOUND;
+	}
+
+	/* print the value that key is being compared to */
+	trace_probe(keys[mid]);
+
+	if ((outcome = cmp(key, keys+mid)) <= 0) {
+		return search_level(keys, lo, mid, key, locn);
+	} else {
+		return search_level(keys, mid+1, hi, key, locn);
+	}
+}
@@ -0,0 +1,15 @@
+gcc -Wall -std=c17 -o program program.c -lm -lpthread
+./program < test0.txt > output0.txt
+./program < test1.txt > output1.txt
+./program -s cone < test2.txt > output2.txt
+./program -q lower < test3.txt > output3.txt
+./program -q upper < test4.txt > output4.txt
+./program -q range < test5.txt > output5.txt
+./program -n 500 -s greedy -U 2000 < test6.txt | grep Segments > output6.txt
+diff output0.txt test0-output.txt
+diff output1.txt test1-output.txt
+diff output2.txt test2-output.txt
+diff output3.txt test3-output.txt
+diff output4.txt test4-output.txt
+diff output5.txt test5-output.txt
+diff output6.txt test6-output.txt
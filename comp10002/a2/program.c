@@ -3,6 +3,31 @@
  * Skeleton code written by Jianzhong Qi, May 2023
  * Edited by: Michael Ren (09 May 2023)
  *
+ * By default the friendships are read as the MAX_USERS x MAX_USERS
+ * matrix of the assignment. With -e they are read as an edge list and
+ * kept in compressed sparse row form instead, for graphs of any size:
+ *   m
+ *   a1 b1
+ *   ...
+ *   am bm
+ * where each line is a friendship between users ai and bi.
+ *
+ * The common friends of two users are counted by the kernel chosen
+ * with -k, SSE2 is used for the SIMD kernel on x86-64. With -b users
+ * with many friends also get a bitset row, and the common friends of
+ * two of them are counted by AND and popcount, 64 users per word (256
+ * or 512 with AVX2 or AVX-512, build with -march=native). Link with
+ * -lpthread for the threads of stage 3 (-t).
+ *
+ * The hashtags are interned to integer ids as they are read, and the
+ * users only keep the ids. With -g the hashtags of a community are
+ * gathered in a bitset over the ids and sorted once, instead of being
+ * inserted into a sorted list. -m reports the memory this saves. With
+ * -a the lists of stage 4 come from an arena that is reset for every
+ * core user, instead of a malloc and a free per node. With -c the
+ * hashtags of every community are kept by its members, and reused for
+ * the later core users with the same community.
+ *
  */
 
 #include <stdio.h>
@@ -10,6 +35,14 @@
 #include <assert.h>
 #include <ctype.h>
 #include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 /* stage numbers */
 #define STAGE_NUM_ONE 1
@@ -21,8 +54,33 @@
 #define STAGE_HEADER "Stage %d\n==========\n"
 
 #define MAX_USERS 50
-#define MAX_TAGS 10
+#define MAX_TAGS 10 /* hashtags of a user in a fixed array of strings */
 #define MAX_TAG_LENGTH 21
+#define INIT_CAPACITY 16 /* initial size of growable arrays */
+
+/* kernels counting the common friends of two users */
+#define KERNEL_AUTO 0
+#define KERNEL_NAIVE 1
+#define KERNEL_MERGE 2
+#define KERNEL_GALLOP 3
+#define KERNEL_SIMD 4
+#define GALLOP_RATIO 16 /* degree ratio from which auto gallops */
+#define BENCH_PAIRS 20000 /* friendships of the busiest users timed by -B */
+#define BENCH_HEADER "Benchmark\n==========\n"
+#define MEMORY_HEADER "Memory\n==========\n"
+#define ARENA_BLOCK 65536 /* bytes of every block of the list arena */
+#define BENCH_ROUNDS 2000 /* passes over all pairs of the matrix timed by -B */
+
+/* bitset rows */
+#define WORD_BITS 64
+#define BITSET_DENSITY 32 /* users with 1/BITSET_DENSITY of all users as
+                             friends get a bitset row */
+
+/* threads of stage 3 */
+#define MAX_THREADS 64
+#define BLOCK_EDGES 1024 /* friendships handed out to a thread at once */
+
+_Static_assert(MAX_USERS <= WORD_BITS, "a matrix row must fit in a word");
 
 /* data_t represent a word */
 typedef char data_t[MAX_TAG_LENGTH];
@@ -31,9 +89,137 @@ typedef struct {
 	int id;
 	int year;
 	int tag_count;
-	data_t tags[MAX_TAGS];
+	int tag_cap;
+	int *tags; /* interned ids of the tags, grows with the tags of the user */
 } user_t;
 
+/* growable heap-backed array of users, indexed by their ids */
+typedef struct {
+	user_t *items;
+	int len; /* number of users read */
+	int cap;
+} user_arr_t;
+
+/* friendships in compressed sparse row form: the friends of user u are
+ * adj[start[u]] to adj[start[u + 1] - 1] in increasing order, and
+ * soc[k] is the strength of connection between u and adj[k] */
+typedef struct {
+	int n;
+	long long *start;
+	int *adj;
+	float *soc;
+	int words; /* words per bitset row */
+	int *bit_row; /* bitset row of every user, -1 if it has none */
+	uint64_t *bits; /* the bitset rows, NULL without -b */
+} graph_t;
+
+/* command line options */
+typedef struct {
+	int edges; /* read the friendships as an edge list */
+	int kernel; /* kernel counting common friends */
+	int bench; /* time the kernels on the busiest users */
+	int bitset; /* bitset rows for users with many friends */
+	int by_edge; /* stage 3 once per friendship */
+	int threads; /* threads of stage 3 on the edge list */
+	int tag_ids; /* gather the hashtags of communities by interned id */
+	int memory; /* report the memory held by the hashtags */
+	int arena; /* lists of stage 4 from an arena */
+	int cache; /* reuse the hashtags of repeated communities */
+} opts_t;
+
+/* hashtags interned to integer ids, in the order they are first read.
+ * every hashtag is kept once, end to end in an arena */
+typedef struct {
+	char *arena;
+	long long used; /* bytes of the arena in use */
+	long long size;
+	long long *offset; /* the hashtag with id i starts at arena + offset[i] */
+	int *rank; /* alphabetical position of every hashtag */
+	int *by_rank; /* the id at every alphabetical position */
+	int len;
+	int cap;
+	int *slots; /* open addressing index of the ids by hash, -1 if free */
+	int slot_cap; /* a power of two, at least twice len */
+} dict_t;
+
+/* the hashtags of a community: a bit per alphabetical rank, and the
+ * ranks that are set, so that they can be sorted and cleared without
+ * looking at the others */
+typedef struct {
+	uint64_t *bits;
+	int *ranks;
+	int len;
+} tag_set_t;
+
+/* a thread of stage 3. it owns the blocks [next, end) of friendships
+ * and works through them from the front, while idle threads steal
+ * half of what is left from the back */
+typedef struct {
+	struct Engine *engine;
+	int id;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	long long next;
+	long long end;
+	long long stolen; /* blocks taken from other threads */
+} worker_t;
+
+/* threads computing the strength of connection of every friendship of
+ * the graph in blocks of BLOCK_EDGES. every value is written to the
+ * position of its friendship, so the result does not depend on which
+ * thread computed it */
+struct Engine {
+	graph_t *graph;
+	int by_edge;
+	int threads; /* the calling thread is worker 0 */
+	long long blocks;
+	worker_t workers[MAX_THREADS];
+};
+
+/* create a new type for the structure */
+typedef struct Engine engine_t;
+
+/* memory for the lists of stage 4, handed out from blocks that are
+ * kept until the end of the run. a reset gives all of it back at once,
+ * which only the lists of one core user are alive for */
+typedef struct {
+	char **blocks;
+	int count; /* blocks allocated */
+	int cap;
+	int block; /* the block being handed out */
+	size_t used; /* bytes handed out from it */
+	void *last; /* the latest allocation, which can be taken back */
+} arena_t;
+
+/* a community seen in stage 4: its members in order, and its hashtags
+ * in the order they are printed, both kept in the pools of the cache */
+typedef struct {
+	unsigned hash;
+	long long members;
+	int member_count;
+	long long tags;
+	int tag_count;
+} community_t;
+
+/* communities of stage 4 by their members, with an open addressing
+ * index by the hash of the members */
+typedef struct {
+	community_t *items;
+	int len;
+	int cap;
+	int *slots; /* -1 if free */
+	int slot_cap; /* a power of two, at least twice len */
+	int *members; /* pool of the members of every community */
+	long long member_len;
+	long long member_cap;
+	int *tags; /* pool of the hashtag ids of every community */
+	long long tag_len;
+	long long tag_cap;
+	long long hits;
+	long long misses;
+	double miss_time; /* spent gathering the hashtags of the misses */
+} cache_t;
+
 /* linked list type definitions below, from
    https://people.eng.unimelb.edu.au/ammoffat/ppsaa/c/listops.c 
 */
@@ -59,7 +245,7 @@ list_t *insert_unique_in_order(list_t *list, data_t value);
 
 void print_stage_header(int stage_num);
 
-void stage_one(user_t users[], int *user_count);
+void stage_one(user_arr_t *users);
 void stage_two(user_t users[], int user_count, int frn_mtx[][MAX_USERS]);
 void stage_three(int user_count, int frn_mtx[][MAX_USERS], float soc_mtx[][MAX_USERS]);
 void stage_four(user_t users[], int user_count, int frn_mtx[][MAX_USERS],
@@ -74,7 +260,117 @@ int get_friends(int id, int user_count, int frn_mtx[][MAX_USERS], int ret[]);
 int sum_intersection(int arr1[], int count1, int arr2[], int count2);
 int sum_union(int arr1[], int count1, int arr2[], int count2);
 float compute_soc(int user1_id, int user2_id, int user_count, int frn_mtx[][MAX_USERS]);
+void stage_three_edges(int user_count, int frn_mtx[][MAX_USERS], float soc_mtx[][MAX_USERS]);
 list_t *insert_tags(list_t *tags, user_t *user);
+void parse_opts(int argc, char *argv[], opts_t *opts);
+user_t *get_user(user_arr_t *users, int id);
+void add_tag(user_t *user, data_t tag);
+void free_users(user_arr_t *users);
+
+/* sparse friendship graph */
+void stage_two_sparse(graph_t *graph);
+void stage_three_sparse(graph_t *graph, opts_t *opts);
+void stage_four_sparse(user_t users[], graph_t *graph);
+void read_edges(graph_t *graph, int user_count);
+int read_int(int *value);
+int cmp_int(const void *x1, const void *x2);
+void *malloc_array(long long count, size_t size);
+int is_friend(graph_t *graph, int user1_id, int user2_id);
+int count_common(int arr1[], int count1, int arr2[], int count2);
+float compute_soc_sparse(graph_t *graph, int user1_id, int user2_id);
+float soc_of_friends(graph_t *graph, int user1_id, int user2_id);
+void free_graph(graph_t *graph);
+
+/* common friends kernels */
+int parse_kernel(char *name, int *kernel);
+int common_naive(int arr1[], int count1, int arr2[], int count2);
+int common_merge(int arr1[], int count1, int arr2[], int count2);
+int common_gallop(int arr1[], int count1, int arr2[], int count2);
+int common_simd(int arr1[], int count1, int arr2[], int count2);
+void bench_kernels(graph_t *graph);
+int cmp_degree(const void *x1, const void *x2);
+double now_sec(void);
+
+/* bitset adjacency */
+void build_bit_rows(int user_count, int frn_mtx[][MAX_USERS], uint64_t rows[]);
+float compute_soc_bits(uint64_t rows[], int user1_id, int user2_id);
+void bench_matrix(int user_count, int frn_mtx[][MAX_USERS]);
+void build_bitsets(graph_t *graph);
+int count_common_users(graph_t *graph, int user1_id, int user2_id);
+int count_in_row(uint64_t row[], int arr[], int count);
+int and_popcount(uint64_t row1[], uint64_t row2[], int words);
+
+/* hashtags by interned id */
+int intern_tag(dict_t *dict, char *tag);
+char *tag_name(dict_t *dict, int id);
+unsigned hash_tag(char *tag);
+void rank_tags(dict_t *dict);
+int cmp_name(const void *x1, const void *x2);
+void make_tag_set(tag_set_t *set, int tag_count);
+void add_tag_ids(tag_set_t *set, dict_t *dict, user_t *user);
+void print_tag_set(tag_set_t *set, dict_t *dict);
+void free_tags(dict_t *dict, tag_set_t *set);
+void report_memory(user_arr_t *users, dict_t *dict, double stage_four_time);
+
+/* arena of the lists of stage 4 */
+void *list_alloc(size_t bytes);
+void list_free(void *ptr);
+void *arena_alloc(arena_t *arena, size_t bytes);
+void arena_undo(arena_t *arena, void *ptr);
+void arena_reset(arena_t *arena);
+void free_arena(arena_t *arena);
+
+/* communities of stage 4 */
+void print_community(user_t users[], int core, int friends[], int count);
+unsigned hash_members(int members[], int count);
+int find_community(cache_t *cache, int members[], int count, unsigned hash);
+int add_community(cache_t *cache, int members[], int count, unsigned hash);
+int gather_tags(list_t *tags, int out[]);
+void print_tag_ids(dict_t *dict, int ids[], int count);
+int *grow_ints(int *arr, long long *cap, long long need);
+void free_cache(cache_t *cache);
+
+/* threads of stage 3 */
+long long compute_edges(graph_t *graph, int by_edge, int threads);
+void *engine_worker(void *arg);
+int engine_take(engine_t *engine, worker_t *worker, long long *block);
+void compute_block(graph_t *graph, long long block, int by_edge);
+void mirror_edges(graph_t *graph);
+void bench_threads(graph_t *graph, int by_edge, int threads);
+
+/****************************************************************/
+
+/* kernel counting common friends, set by -k */
+static int soc_kernel = KERNEL_AUTO;
+
+/* degrees of the users, used to sort them for the benchmark */
+static long long *bench_degrees;
+
+/* the friendship matrix as one bitset row per user, used by compute_soc
+ * when use_bitsets is set by -b */
+static int use_bitsets;
+static uint64_t frn_bits[MAX_USERS];
+
+/* the interned hashtags of all users, and the hashtags of the current
+ * community, used instead of the sorted lists when use_tag_ids is set
+ * by -g */
+static int use_tag_ids;
+static dict_t tag_dict;
+static tag_set_t tag_set;
+
+/* the interned hashtags, used to sort the ids */
+static dict_t *sort_dict;
+
+/* the arena of the lists, used by list_alloc and list_free when
+ * use_arena is set by -a, and the calls they made to malloc and free */
+static int use_arena;
+static arena_t list_arena;
+static long long list_mallocs, list_frees;
+
+/* the communities of stage 4, used by print_community when use_cache is
+ * set by -c */
+static int use_cache;
+static cache_t comm_cache;
 
 /****************************************************************/
 
@@ -82,24 +378,167 @@ list_t *insert_tags(list_t *tags, user_t *user);
 /* main function controls all the action; modify if needed */
 int
 main(int argc, char *argv[]) {
-	user_t users[MAX_USERS];
-	int user_count = 0;
+	opts_t opts;
+	parse_opts(argc, argv, &opts);
+
+	user_arr_t users = {NULL, 0, 0};
 	int frn_mtx[MAX_USERS][MAX_USERS]; /* friendship matrix */
 	float soc_mtx[MAX_USERS][MAX_USERS]; /* strength of connection matrix */
 
 	/* stage 1: read user profiles */
-	stage_one(users, &user_count);
+	stage_one(&users);
+	int user_count = users.len;
+	if (use_tag_ids) {
+		rank_tags(&tag_dict);
+		make_tag_set(&tag_set, tag_dict.len);
+	}
+
+	if (opts.edges) {
+		/* the same stages on the sparse friendship graph */
+		graph_t graph;
+		read_edges(&graph, user_count);
+		if (opts.bitset) {
+			build_bitsets(&graph);
+		}
+		stage_two_sparse(&graph);
+		stage_three_sparse(&graph, &opts);
+		double start = now_sec();
+		stage_four_sparse(users.items, &graph);
+		double stage_four_time = now_sec() - start;
+		free_arena(&list_arena);
+		if (opts.bench) {
+			bench_kernels(&graph);
+			bench_threads(&graph, opts.by_edge, opts.threads);
+		}
+		if (opts.memory) {
+			report_memory(&users, &tag_dict, stage_four_time);
+		}
+		free_graph(&graph);
+		free_users(&users);
+		free_tags(&tag_dict, &tag_set);
+		free_cache(&comm_cache);
+		return 0;
+	}
+
+	if (user_count > MAX_USERS) {
+		fprintf(stderr, "more than %d users need an edge list (-e)\n", MAX_USERS);
+		exit(EXIT_FAILURE);
+	}
 	
 	/* stage 2: compute the strength of connection between u0 and u1 */
-	stage_two(users, user_count, frn_mtx);
+	stage_two(users.items, user_count, frn_mtx);
 	
 	/* stage 3: compute the strength of connection for all user pairs */
-	stage_three(user_count, frn_mtx, soc_mtx);
+	if (opts.by_edge) {
+		stage_three_edges(user_count, frn_mtx, soc_mtx);
+	} else {
+		stage_three(user_count, frn_mtx, soc_mtx);
+	}
 	
 	/* stage 4: detect communities and topics of interest */
-	stage_four(users, user_count, frn_mtx, soc_mtx);
+	double start = now_sec();
+	stage_four(users.items, user_count, frn_mtx, soc_mtx);
+	double stage_four_time = now_sec() - start;
+	free_arena(&list_arena);
+	if (opts.memory) {
+		report_memory(&users, &tag_dict, stage_four_time);
+	}
+	if (opts.bench) {
+		bench_matrix(user_count, frn_mtx);
+	}
 	
 	/* all done; take some rest */
+	free_users(&users);
+	free_tags(&tag_dict, &tag_set);
+	free_cache(&comm_cache);
+	return 0;
+}
+
+/* read command line options:
+ *   -e     read the friendships as an edge list instead of a matrix
+ *   -k auto|naive|merge|gallop|simd
+ *          kernel counting the common friends of two users (default
+ *          auto: gallop when one user has GALLOP_RATIO times as many
+ *          friends as the other, simd otherwise)
+ *   -b     keep bitset rows: for every user of the matrix, or with -e
+ *          for the users with at least 1/BITSET_DENSITY of all users
+ *          as friends
+ *   -E     compute stage 3 once per friendship, skipping the users who
+ *          are not friends and reusing it for both directions
+ *   -t n   compute stage 3 of the edge list on n threads
+ *   -g     gather the hashtags of every community by interned id in a
+ *          bitset, instead of inserting them into a sorted list
+ *   -a     take the lists of stage 4 from an arena, reset for every
+ *          core user
+ *   -c     gather the hashtags of every community once, reusing them
+ *          for the later core users with the same members
+ *   -m     report the memory held by the hashtags of the users, and
+ *          the allocations, time and reused communities of stage 4
+ *   -B     time every kernel on the friendships of the busiest users,
+ *          then stage 3 on 1 to n threads, or without -e every kernel
+ *          on every pair of the matrix
+ */
+void parse_opts(int argc, char *argv[], opts_t *opts) {
+	opts->edges = 0;
+	opts->kernel = KERNEL_AUTO;
+	opts->bench = 0;
+	opts->bitset = 0;
+	opts->by_edge = 0;
+	opts->threads = 1;
+	opts->tag_ids = 0;
+	opts->memory = 0;
+	opts->arena = 0;
+	opts->cache = 0;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-e") == 0) {
+			opts->edges = 1;
+		} else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc
+				&& parse_kernel(argv[i + 1], &opts->kernel)) {
+			i++;
+		} else if (strcmp(argv[i], "-B") == 0) {
+			opts->bench = 1;
+		} else if (strcmp(argv[i], "-b") == 0) {
+			opts->bitset = 1;
+		} else if (strcmp(argv[i], "-E") == 0) {
+			opts->by_edge = 1;
+		} else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+			opts->threads = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-g") == 0) {
+			opts->tag_ids = 1;
+		} else if (strcmp(argv[i], "-m") == 0) {
+			opts->memory = 1;
+		} else if (strcmp(argv[i], "-a") == 0) {
+			opts->arena = 1;
+		} else if (strcmp(argv[i], "-c") == 0) {
+			opts->cache = 1;
+		} else {
+			fprintf(stderr, "usage: %s [-e] [-k auto|naive|merge|gallop|simd] [-b] [-E] "
+				"[-t threads] [-g] [-a] [-c] [-m] [-B]\n",
+				argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (opts->threads < 1 || opts->threads > MAX_THREADS) {
+		fprintf(stderr, "the number of threads must be 1 to %d\n", MAX_THREADS);
+		exit(EXIT_FAILURE);
+	}
+	soc_kernel = opts->kernel;
+	use_bitsets = opts->bitset;
+	use_tag_ids = opts->tag_ids;
+	use_arena = opts->arena;
+	use_cache = opts->cache;
+}
+
+/* parse the name of a kernel, returns 0 if it is unknown */
+int parse_kernel(char *name, int *kernel) {
+	char *names[] = {"auto", "naive", "merge", "gallop", "simd"};
+	for (int i = 0; i < (int) (sizeof(names) / sizeof(*names)); i++) {
+		if (strcmp(name, names[i]) == 0) {
+			*kernel = i;
+			return 1;
+		}
+	}
 	return 0;
 }
 
@@ -119,7 +558,7 @@ int array_contains(int arr[], int count, int value) {
 void print_tags(user_t *user) {
 	int count = user->tag_count;
 	for (int i = 0; i < count; i++) {
-		printf("#%s", user->tags[i]);
+		printf("#%s", tag_name(&tag_dict, user->tags[i]));
 		if (i < count - 1) {
 			printf(" ");
 		}
@@ -179,15 +618,25 @@ int sum_union(int arr1[], int count1, int arr2[], int count2) {
 
 /* compute the strength of connection for a given user */
 float compute_soc(int user1_id, int user2_id, int user_count, int frn_mtx[][MAX_USERS]) {
+	if (use_bitsets) {
+		return compute_soc_bits(frn_bits, user1_id, user2_id);
+	}
+
 	/* get the friends of two users */
 	int friends1[user_count];
 	int friends2[user_count];
 	int f1_count = get_friends(user1_id, user_count, frn_mtx, friends1);
 	int f2_count = get_friends(user2_id, user_count, frn_mtx, friends2);
 
-	/* find the union and intersections */
-	int intersect_count = sum_intersection(friends1, f1_count, friends2, f2_count);
-	int union_count = sum_union(friends1, f1_count, friends2, f2_count);
+	/* find the union and intersections, the friends are in order */
+	int intersect_count, union_count;
+	if (soc_kernel == KERNEL_NAIVE) {
+		intersect_count = sum_intersection(friends1, f1_count, friends2, f2_count);
+		union_count = sum_union(friends1, f1_count, friends2, f2_count);
+	} else {
+		intersect_count = count_common(friends1, f1_count, friends2, f2_count);
+		union_count = f1_count + f2_count - intersect_count;
+	}
 
 	/* calculate the strength of connection */
 	if (frn_mtx[user1_id][user2_id]) {
@@ -197,51 +646,100 @@ float compute_soc(int user1_id, int user2_id, int user_count, int frn_mtx[][MAX_
 	return 0;
 }
 
-/* wrapping function to uniquely insert a list of tags */
+/* wrapping function to uniquely insert a list of tags, with -g they
+ * go to the set of the community instead */
 list_t *insert_tags(list_t *tags, user_t *user) {
+	if (use_tag_ids) {
+		add_tag_ids(&tag_set, &tag_dict, user);
+		return tags;
+	}
 	for (int i = 0; i < user->tag_count; i++) {
-		tags = insert_unique_in_order(tags, user->tags[i]);
+		tags = insert_unique_in_order(tags, tag_name(&tag_dict, user->tags[i]));
 	}
 	return tags;
 }
 
 /* stage 1: read user profiles */
 void 
-stage_one(user_t users[], int *user_count) {
+stage_one(user_arr_t *users) {
 	/* print stage header */
 	print_stage_header(STAGE_NUM_ONE);
-	user_t *max_tag_user;
+	int max_tag_id = -1; /* users may move as the array grows */
 	int max_tag_count = 0;
 
 	int id, year;
-	while (scanf("u%d %d", &id, &year)) {
+	while (scanf("u%d %d", &id, &year) == 2) {
 		/* initialise user */
-		user_t *user = &users[id];
+		user_t *user = get_user(users, id);
 		user->id = id;
 		user->year = year;
 		user->tag_count = 0;
-		(*user_count)++;
+		users->len++;
 
 		/* read tags */
 		char tag[MAX_TAG_LENGTH];
-		while (scanf(" #%s", tag)) {
-			strcpy(user->tags[user->tag_count], tag);
-			user->tag_count++;
+		while (scanf(" #%20s", tag) == 1) {
+			add_tag(user, tag);
 		}
 
 		/* find the user with most hashtags */
-		if (user->tag_count > max_tag_count) {
-			max_tag_user = user;
+		if (max_tag_id < 0 || user->tag_count > max_tag_count) {
+			max_tag_id = id;
 			max_tag_count = user->tag_count;
 		}
 	}
 
-	printf("Number of users: %d\n", *user_count);
-	printf("u%d has the largest number of hashtags:\n", max_tag_user->id);
-	print_tags(max_tag_user);
+	if (max_tag_id < 0) {
+		fprintf(stderr, "expected at least one user profile\n");
+		exit(EXIT_FAILURE);
+	}
+	printf("Number of users: %d\n", users->len);
+	printf("u%d has the largest number of hashtags:\n", max_tag_id);
+	print_tags(&users->items[max_tag_id]);
 	printf("\n");
 }
 
+/* the user with an id, growing the array to hold it */
+user_t *get_user(user_arr_t *users, int id) {
+	if (id < 0) {
+		fprintf(stderr, "invalid user id u%d\n", id);
+		exit(EXIT_FAILURE);
+	}
+	if (id >= users->cap) {
+		int cap = users->cap > 0 ? users->cap : INIT_CAPACITY;
+		while (cap <= id) {
+			cap *= 2;
+		}
+		users->items = (user_t*)realloc(users->items, sizeof(*users->items) * cap);
+		assert(users->items!=NULL);
+		memset(users->items + users->cap, 0, sizeof(*users->items) * (cap - users->cap));
+		users->cap = cap;
+	}
+	return &users->items[id];
+}
+
+/* append the id of a tag to a user, doubling the space for tags when
+ * it is full */
+void add_tag(user_t *user, data_t tag) {
+	if (user->tag_count == user->tag_cap) {
+		user->tag_cap = user->tag_cap > 0 ? user->tag_cap * 2 : 4;
+		user->tags = (int*)realloc(user->tags, sizeof(*user->tags) * user->tag_cap);
+		assert(user->tags!=NULL);
+	}
+	user->tags[user->tag_count] = intern_tag(&tag_dict, tag);
+	user->tag_count++;
+}
+
+/* free the memory held by the users and their tags */
+void free_users(user_arr_t *users) {
+	for (int i = 0; i < users->cap; i++) {
+		free(users->items[i].tags);
+	}
+	free(users->items);
+	users->items = NULL;
+	users->len = users->cap = 0;
+}
+
 /* stage 2: compute the strength of connection between u0 and u1 */
 void 
 stage_two(user_t users[], int user_count, int frn_mtx[][MAX_USERS]) {
@@ -250,6 +748,9 @@ stage_two(user_t users[], int user_count, int frn_mtx[][MAX_USERS]) {
 
 	/* read the entire matrix */
 	read_matrix(frn_mtx, user_count);
+	if (use_bitsets) {
+		build_bit_rows(user_count, frn_mtx, frn_bits);
+	}
 
 	/* compute the strength of connection */
 	float strength = compute_soc(0, 1, user_count, frn_mtx);
@@ -280,6 +781,57 @@ stage_three(int user_count, int frn_mtx[][MAX_USERS], float soc_mtx[][MAX_USERS]
 	printf("\n");
 }
 
+/* stage 3 driven by the friendships: the friends of every user are
+ * listed once, and the strength of connection is computed once for
+ * each pair of friends and stored for both directions. users who are
+ * not friends are left at 0 without looking at their friends */
+void stage_three_edges(int user_count, int frn_mtx[][MAX_USERS], float soc_mtx[][MAX_USERS]) {
+	/* print stage header */
+	print_stage_header(STAGE_NUM_THREE);
+
+	int friends[MAX_USERS][MAX_USERS];
+	int f_count[MAX_USERS];
+	for (int i = 0; i < user_count; i++) {
+		f_count[i] = get_friends(i, user_count, frn_mtx, friends[i]);
+		memset(soc_mtx[i], 0, sizeof(**soc_mtx) * user_count);
+	}
+
+	for (int i = 0; i < user_count; i++) {
+		for (int k = 0; k < f_count[i]; k++) {
+			int j = friends[i][k];
+			if (j < i && frn_mtx[j][i]) {
+				continue; /* done from the other side */
+			}
+
+			float strength;
+			if (use_bitsets) {
+				strength = compute_soc_bits(frn_bits, i, j);
+			} else {
+				int intersect_count = count_common(friends[i], f_count[i],
+					friends[j], f_count[j]);
+				int union_count = f_count[i] + f_count[j] - intersect_count;
+				strength = (float) intersect_count / (float) union_count;
+			}
+			soc_mtx[i][j] = strength;
+			if (frn_mtx[j][i]) {
+				soc_mtx[j][i] = strength;
+			}
+		}
+	}
+
+	for (int i = 0; i < user_count; i++) {
+		for (int j = 0; j < user_count; j++) {
+			printf("%4.2f", soc_mtx[i][j]);
+			if (j < user_count - 1) {
+				printf(" ");
+			}
+		}
+		printf("\n");
+	}
+
+	printf("\n");
+}
+
 /* stage 4: detect communities and topics of interest */
 void 
 stage_four(user_t users[], int user_count, int frn_mtx[][MAX_USERS], float soc_mtx[][MAX_USERS]) {
@@ -308,6 +860,10 @@ stage_four(user_t users[], int user_count, int frn_mtx[][MAX_USERS], float soc_m
 		if (cls_friend_count > thc) { /* check if user is a core user */
 			printf("Stage 4.1. Core user: u%d; ", i);
 			printf("close friends:");
+			if (use_cache) {
+				print_community(users, i, cls_friends, cls_friend_count);
+				continue;
+			}
 
 			list_t *tags = make_empty_list();
 			user_t *user = &users[i];
@@ -325,12 +881,1253 @@ stage_four(user_t users[], int user_count, int frn_mtx[][MAX_USERS], float soc_m
 			}
 
 			printf("\nStage 4.2. Hashtags:\n");
-			print_list(tags);
+			if (use_tag_ids) {
+				print_tag_set(&tag_set, &tag_dict);
+			} else {
+				print_list(tags);
+			}
 			free_list(tags);
 		}
 	}
 }
 
+/****************************************************************/
+/* sparse friendship graph */
+
+/* stage 2 on the sparse graph */
+void stage_two_sparse(graph_t *graph) {
+	/* print stage header */
+	print_stage_header(STAGE_NUM_TWO);
+
+	float strength = graph->n > 1 ? compute_soc_sparse(graph, 0, 1) : 0;
+	printf("Strength of connection between u0 and u1: %4.2f\n", strength);
+	printf("\n");
+}
+
+/* stage 3 on the sparse graph: the strength of connection is only
+ * computed for friends, as it is 0 for everyone else. with -E it is
+ * computed once per friendship, from the user with the smaller id, and
+ * stored for both directions. small graphs are printed as the full
+ * matrix, bigger ones are summarised */
+void stage_three_sparse(graph_t *graph, opts_t *opts) {
+	/* print stage header */
+	print_stage_header(STAGE_NUM_THREE);
+
+	int n = graph->n;
+	compute_edges(graph, opts->by_edge, opts->threads);
+	if (opts->by_edge) {
+		mirror_edges(graph);
+	}
+
+	double total = 0;
+	for (long long k = 0; k < graph->start[n]; k++) {
+		total += graph->soc[k];
+	}
+
+	long long entries = graph->start[n];
+	if (n <= MAX_USERS) {
+		for (int i = 0; i < n; i++) {
+			long long k = graph->start[i];
+			for (int j = 0; j < n; j++) {
+				float strength = 0;
+				if (k < graph->start[i + 1] && graph->adj[k] == j) {
+					strength = graph->soc[k++];
+				}
+				printf("%4.2f", strength);
+				if (j < n - 1) {
+					printf(" ");
+				}
+			}
+			printf("\n");
+		}
+	} else {
+		printf("Friendships: %lld\n", entries / 2);
+		printf("Average strength of connection between friends: %4.2f\n",
+			entries > 0 ? total / entries : 0);
+	}
+
+	printf("\n");
+}
+
+/* stage 4 on the sparse graph */
+void stage_four_sparse(user_t users[], graph_t *graph) {
+	/* print stage header */
+	print_stage_header(STAGE_NUM_FOUR);
+
+	float ths = 0;
+	int thc = 0;
+	if (scanf("%f %d", &ths, &thc) != 2) {
+		fprintf(stderr, "expected the two thresholds of stage 4\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 0; i < graph->n; i++) {
+		/* count close friends first, most users are not core users */
+		int cls_friend_count = 0;
+		for (long long k = graph->start[i]; k < graph->start[i + 1]; k++) {
+			cls_friend_count += graph->soc[k] > ths;
+		}
+		if (cls_friend_count <= thc) {
+			continue;
+		}
+
+		printf("Stage 4.1. Core user: u%d; ", i);
+		printf("close friends:");
+		if (use_cache) {
+			/* the close friends are in order, as the friends are */
+			int *cls_friends = (int*)malloc(sizeof(*cls_friends) * cls_friend_count);
+			assert(cls_friends!=NULL);
+			int count = 0;
+			for (long long k = graph->start[i]; k < graph->start[i + 1]; k++) {
+				if (graph->soc[k] > ths) {
+					cls_friends[count++] = graph->adj[k];
+				}
+			}
+			print_community(users, i, cls_friends, count);
+			free(cls_friends);
+			continue;
+		}
+
+		/* insert tags from the core user, then from the close friends */
+		list_t *tags = make_empty_list();
+		tags = insert_tags(tags, &users[i]);
+		for (long long k = graph->start[i]; k < graph->start[i + 1]; k++) {
+			if (graph->soc[k] > ths) {
+				int id = graph->adj[k];
+				printf(" u%d", id);
+				tags = insert_tags(tags, &users[id]);
+			}
+		}
+
+		printf("\nStage 4.2. Hashtags:\n");
+		if (use_tag_ids) {
+			print_tag_set(&tag_set, &tag_dict);
+		} else {
+			print_list(tags);
+		}
+		free_list(tags);
+	}
+}
+
+/* read the edge list and build the graph over user_count users. each
+ * friendship is stored in both directions, repeated friendships and
+ * friendships of users with themselves are dropped */
+void read_edges(graph_t *graph, int user_count) {
+	int m = 0;
+	if (!read_int(&m) || m < 0) {
+		fprintf(stderr, "expected the number of friendships\n");
+		exit(EXIT_FAILURE);
+	}
+
+	int *ends = (int*)malloc_array(2 * (long long) m, sizeof(*ends));
+	long long *start = (long long*)calloc(user_count + 1, sizeof(*start));
+	assert(ends!=NULL && start!=NULL);
+	for (long long e = 0; e < 2 * (long long) m; e++) {
+		if (!read_int(&ends[e]) || ends[e] < 0 || ends[e] >= user_count) {
+			fprintf(stderr, "expected %d friendships between users u0 to u%d\n",
+				m, user_count - 1);
+			exit(EXIT_FAILURE);
+		}
+		start[ends[e] + 1]++;
+	}
+
+	/* count the friends of every user, then place them */
+	for (int i = 0; i < user_count; i++) {
+		start[i + 1] += start[i];
+	}
+	int *adj = (int*)malloc_array(start[user_count], sizeof(*adj));
+	long long *next = (long long*)malloc(sizeof(*next) * (user_count + 1));
+	assert(adj!=NULL && next!=NULL);
+	memcpy(next, start, sizeof(*next) * (user_count + 1));
+	for (long long e = 0; e < 2 * (long long) m; e += 2) {
+		adj[next[ends[e]]++] = ends[e + 1];
+		adj[next[ends[e + 1]]++] = ends[e];
+	}
+	free(ends);
+
+	/* sort every row and squeeze out the repeats in place */
+	long long len = 0;
+	for (int i = 0; i < user_count; i++) {
+		long long first = start[i], last = start[i + 1];
+		start[i] = len;
+		qsort(adj + first, last - first, sizeof(*adj), cmp_int);
+		for (long long k = first; k < last; k++) {
+			if (adj[k] != i && (len == start[i] || adj[len - 1] != adj[k])) {
+				adj[len++] = adj[k];
+			}
+		}
+	}
+	start[user_count] = len;
+	free(next);
+
+	graph->n = user_count;
+	graph->start = start;
+	graph->adj = adj;
+	graph->soc = (float*)malloc_array(len, sizeof(*graph->soc));
+	assert(graph->soc!=NULL);
+	graph->words = 0;
+	graph->bit_row = NULL;
+	graph->bits = NULL;
+}
+
+/* read a non-negative integer, returns 0 if there is none */
+int read_int(int *value) {
+	int c = getchar();
+	while (isspace(c)) {
+		c = getchar();
+	}
+	if (!isdigit(c)) {
+		return 0;
+	}
+	*value = 0;
+	while (isdigit(c)) {
+		*value = *value * 10 + (c - '0');
+		c = getchar();
+	}
+	return 1;
+}
+
+/* malloc count items of size bytes, and at least one so that an empty
+ * array is still a valid pointer */
+void *malloc_array(long long count, size_t size) {
+	return malloc(size * (size_t) (count > 0 ? count : 1));
+}
+
+/* compare two ints for qsort */
+int cmp_int(const void *x1, const void *x2) {
+	int a = *(const int*)x1, b = *(const int*)x2;
+	return (a > b) - (a < b);
+}
+
+/* check if two users are friends, by binary search */
+int is_friend(graph_t *graph, int user1_id, int user2_id) {
+	long long lo = graph->start[user1_id], hi = graph->start[user1_id + 1];
+	while (lo < hi) {
+		long long mid = (lo + hi) / 2;
+		if (graph->adj[mid] < user2_id) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo < graph->start[user1_id + 1] && graph->adj[lo] == user2_id;
+}
+
+/* return the number of items in both of two sorted arrays of distinct
+ * items, with the kernel chosen by -k */
+int count_common(int arr1[], int count1, int arr2[], int count2) {
+	int kernel = soc_kernel;
+	if (kernel == KERNEL_AUTO) {
+		int small = count1 < count2 ? count1 : count2;
+		int large = count1 + count2 - small;
+		kernel = (long long) small * GALLOP_RATIO <= large ? KERNEL_GALLOP : KERNEL_SIMD;
+	}
+
+	if (kernel == KERNEL_NAIVE) {
+		return common_naive(arr1, count1, arr2, count2);
+	} else if (kernel == KERNEL_MERGE) {
+		return common_merge(arr1, count1, arr2, count2);
+	} else if (kernel == KERNEL_GALLOP) {
+		return common_gallop(arr1, count1, arr2, count2);
+	}
+	return common_simd(arr1, count1, arr2, count2);
+}
+
+/* compute the strength of connection between two users of the graph */
+float compute_soc_sparse(graph_t *graph, int user1_id, int user2_id) {
+	if (!is_friend(graph, user1_id, user2_id)) {
+		return 0;
+	}
+	return soc_of_friends(graph, user1_id, user2_id);
+}
+
+/* compute the strength of connection between two friends */
+float soc_of_friends(graph_t *graph, int user1_id, int user2_id) {
+	int f1_count = graph->start[user1_id + 1] - graph->start[user1_id];
+	int f2_count = graph->start[user2_id + 1] - graph->start[user2_id];
+
+	/* the union is what is in either list, less what is in both */
+	int intersect_count = count_common_users(graph, user1_id, user2_id);
+	int union_count = f1_count + f2_count - intersect_count;
+	return (float) intersect_count / (float) union_count;
+}
+
+/* free the memory held by the graph */
+void free_graph(graph_t *graph) {
+	free(graph->start);
+	free(graph->adj);
+	free(graph->soc);
+	free(graph->bit_row);
+	free(graph->bits);
+	graph->bit_row = NULL;
+	graph->bits = NULL;
+	graph->start = NULL;
+	graph->adj = NULL;
+	graph->soc = NULL;
+	graph->n = 0;
+}
+
+/****************************************************************/
+/* common friends kernels */
+
+/* count the common items the way sum_intersection does, by looking
+ * every item of arr1 up in arr2 */
+int common_naive(int arr1[], int count1, int arr2[], int count2) {
+	return sum_intersection(arr1, count1, arr2, count2);
+}
+
+/* count the common items by merging the two arrays, advancing both
+ * sides without branches */
+int common_merge(int arr1[], int count1, int arr2[], int count2) {
+	int n = 0, i = 0, j = 0;
+	while (i < count1 && j < count2) {
+		int a = arr1[i], b = arr2[j];
+		n += a == b;
+		i += a <= b;
+		j += b <= a;
+	}
+	return n;
+}
+
+/* count the common items by looking every item of the shorter array
+ * up in the longer one: gallop past the smaller items, then binary
+ * search the last step. costs O(small log(large / small)) */
+int common_gallop(int arr1[], int count1, int arr2[], int count2) {
+	if (count1 > count2) {
+		return common_gallop(arr2, count2, arr1, count1);
+	}
+
+	int n = 0, lo = 0;
+	for (int i = 0; i < count1 && lo < count2; i++) {
+		int key = arr1[i];
+
+		/* arr2[lo + step / 2 - 1] < key <= arr2[lo + step - 1] */
+		int step = 1;
+		while (lo + step - 1 < count2 && arr2[lo + step - 1] < key) {
+			step *= 2;
+		}
+		int hi = lo + step < count2 ? lo + step : count2;
+		lo += step / 2;
+		while (lo < hi) {
+			int mid = (lo + hi) / 2;
+			if (arr2[mid] < key) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		if (lo < count2 && arr2[lo] == key) {
+			n++;
+			lo++;
+		}
+	}
+	return n;
+}
+
+/* count the common items four by four: every item of a block of arr1
+ * is compared with every item of a block of arr2 by comparing the
+ * blocks in all four rotations, then the block with the smaller last
+ * item is replaced. the rest is merged */
+int common_simd(int arr1[], int count1, int arr2[], int count2) {
+	int n = 0, i = 0, j = 0;
+
+#if defined(__SSE2__)
+	while (i + 4 <= count1 && j + 4 <= count2) {
+		__m128i a = _mm_loadu_si128((__m128i*) (arr1 + i));
+		__m128i b = _mm_loadu_si128((__m128i*) (arr2 + j));
+		__m128i eq = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi32(a, b),
+				_mm_cmpeq_epi32(a, _mm_shuffle_epi32(b, _MM_SHUFFLE(0, 3, 2, 1)))),
+			_mm_or_si128(_mm_cmpeq_epi32(a, _mm_shuffle_epi32(b, _MM_SHUFFLE(1, 0, 3, 2))),
+				_mm_cmpeq_epi32(a, _mm_shuffle_epi32(b, _MM_SHUFFLE(2, 1, 0, 3)))));
+		n += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(eq)));
+
+		int a_last = arr1[i + 3], b_last = arr2[j + 3];
+		i += (a_last <= b_last) * 4;
+		j += (b_last <= a_last) * 4;
+	}
+#endif
+
+	return n + common_merge(arr1 + i, count1 - i, arr2 + j, count2 - j);
+}
+
+/* time every kernel on the friendships of the busiest users, which
+ * have the most friends to compare */
+void bench_kernels(graph_t *graph) {
+	printf(BENCH_HEADER);
+
+	/* the users by decreasing number of friends */
+	int n = graph->n;
+	int *order = (int*)malloc_array(n, sizeof(*order));
+	long long *degrees = (long long*)malloc_array(n, sizeof(*degrees));
+	assert(order!=NULL && degrees!=NULL);
+	for (int i = 0; i < n; i++) {
+		order[i] = i;
+		degrees[i] = graph->start[i + 1] - graph->start[i];
+	}
+	bench_degrees = degrees;
+	qsort(order, n, sizeof(*order), cmp_degree);
+
+	/* their friendships, up to BENCH_PAIRS of them */
+	int *pairs = (int*)malloc(sizeof(*pairs) * 2 * BENCH_PAIRS);
+	assert(pairs!=NULL);
+	int count = 0;
+	long long friends = 0;
+	for (int r = 0; r < n && count < BENCH_PAIRS; r++) {
+		int u = order[r];
+		for (long long k = graph->start[u]; k < graph->start[u + 1] && count < BENCH_PAIRS; k++) {
+			pairs[2 * count] = u;
+			pairs[2 * count + 1] = graph->adj[k];
+			friends += degrees[u] + degrees[graph->adj[k]];
+			count++;
+		}
+	}
+	printf("Friendships: %d, average friends per user: %.1f\n",
+		count, count > 0 ? friends / (2.0 * count) : 0);
+
+	char *names[] = {"auto", "naive", "merge", "gallop", "simd"};
+	long long expected = -1;
+	double naive_time = 0;
+	int kernel = soc_kernel;
+	for (int k = KERNEL_NAIVE; k <= KERNEL_SIMD + 1; k++) {
+		/* auto last, so that it is compared against all the others */
+		soc_kernel = k % (KERNEL_SIMD + 1);
+		long long common = 0;
+		double start = now_sec();
+		for (int p = 0; p < count; p++) {
+			int u = pairs[2 * p], v = pairs[2 * p + 1];
+			common += count_common(graph->adj + graph->start[u], degrees[u],
+				graph->adj + graph->start[v], degrees[v]);
+		}
+		double time = now_sec() - start;
+		naive_time = soc_kernel == KERNEL_NAIVE ? time : naive_time;
+		printf("Kernel %-6s: %8.4f s (%6.1fx), %lld common friends%s\n",
+			names[soc_kernel], time, naive_time / time, common,
+			expected < 0 || common == expected ? "" : ", MISMATCH");
+		expected = expected < 0 ? common : expected;
+	}
+	soc_kernel = kernel;
+
+	/* the same friendships through the bitset rows */
+	int built = graph->bits == NULL;
+	if (built) {
+		build_bitsets(graph);
+	}
+	long long common = 0;
+	double start = now_sec();
+	for (int p = 0; p < count; p++) {
+		common += count_common_users(graph, pairs[2 * p], pairs[2 * p + 1]);
+	}
+	double time = now_sec() - start;
+	int rows = 0;
+	for (int i = 0; i < n; i++) {
+		rows += graph->bit_row[i] >= 0;
+	}
+	printf("Kernel bitset: %8.4f s (%6.1fx), %lld common friends%s, %d rows of %d words\n",
+		time, naive_time / time, common, common == expected ? "" : ", MISMATCH",
+		rows, graph->words);
+	if (built) {
+		free(graph->bit_row);
+		free(graph->bits);
+		graph->bit_row = NULL;
+		graph->bits = NULL;
+	}
+
+	free(order);
+	free(degrees);
+	free(pairs);
+}
+
+/* compare two users by decreasing number of friends, for qsort */
+int cmp_degree(const void *x1, const void *x2) {
+	long long a = bench_degrees[*(const int*)x1], b = bench_degrees[*(const int*)x2];
+	return (a < b) - (a > b);
+}
+
+/* wall clock time in seconds */
+double now_sec(void) {
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/****************************************************************/
+/* bitset adjacency */
+
+/* one bitset row per user of the matrix, bit j of row i is set if
+ * users i and j are friends */
+void build_bit_rows(int user_count, int frn_mtx[][MAX_USERS], uint64_t rows[]) {
+	for (int i = 0; i < user_count; i++) {
+		rows[i] = 0;
+		for (int j = 0; j < user_count; j++) {
+			rows[i] |= (uint64_t) (frn_mtx[i][j] != 0) << j;
+		}
+	}
+}
+
+/* compute the strength of connection from the bitset rows, the same
+ * value compute_soc finds from the matrix */
+float compute_soc_bits(uint64_t rows[], int user1_id, int user2_id) {
+	if (!((rows[user1_id] >> user2_id) & 1)) {
+		return 0;
+	}
+	int intersect_count = __builtin_popcountll(rows[user1_id] & rows[user2_id]);
+	int union_count = __builtin_popcountll(rows[user1_id] | rows[user2_id]);
+	return (float) intersect_count / (float) union_count;
+}
+
+/* time BENCH_ROUNDS passes of stage 3 over the matrix, with the int
+ * matrix and every kernel, then with the bitset rows */
+void bench_matrix(int user_count, int frn_mtx[][MAX_USERS]) {
+	printf(BENCH_HEADER);
+	build_bit_rows(user_count, frn_mtx, frn_bits);
+
+	char *names[] = {"auto", "naive", "merge", "gallop", "simd"};
+	int kernel = soc_kernel, bitsets = use_bitsets;
+	double expected = -1, naive_time = 0;
+	for (int k = KERNEL_NAIVE; k <= KERNEL_SIMD + 2; k++) {
+		/* auto after the others, then the bitset rows */
+		soc_kernel = k % (KERNEL_SIMD + 1);
+		use_bitsets = k == KERNEL_SIMD + 2;
+		double total = 0;
+		double start = now_sec();
+		for (int round = 0; round < BENCH_ROUNDS; round++) {
+			for (int i = 0; i < user_count; i++) {
+				for (int j = 0; j < user_count; j++) {
+					total += compute_soc(i, j, user_count, frn_mtx);
+				}
+			}
+		}
+		double time = now_sec() - start;
+		naive_time = k == KERNEL_NAIVE ? time : naive_time;
+		printf("%s %-6s: %8.4f s (%6.1fx)%s\n",
+			use_bitsets ? "Bitset" : "Matrix", use_bitsets ? "rows" : names[soc_kernel],
+			time, naive_time / time,
+			expected < 0 || total == expected ? "" : ", MISMATCH");
+		expected = expected < 0 ? total : expected;
+	}
+	soc_kernel = kernel;
+	use_bitsets = bitsets;
+	printf("\n");
+}
+
+/* give a bitset row to every user with at least 1/BITSET_DENSITY of all
+ * users as friends. two such rows are ANDed in n / 64 words, fewer than
+ * the 2n / BITSET_DENSITY friends a merge would step through, and the
+ * rows take at most BITSET_DENSITY / 4 bytes per friendship */
+void build_bitsets(graph_t *graph) {
+	int n = graph->n, rows = 0;
+	graph->words = (n + WORD_BITS - 1) / WORD_BITS;
+	graph->bit_row = (int*)malloc_array(n, sizeof(*graph->bit_row));
+	assert(graph->bit_row!=NULL);
+	for (int i = 0; i < n; i++) {
+		long long degree = graph->start[i + 1] - graph->start[i];
+		graph->bit_row[i] = degree > 0 && degree * BITSET_DENSITY >= n ? rows++ : -1;
+	}
+
+	graph->bits = (uint64_t*)calloc((size_t) rows * graph->words + 1, sizeof(*graph->bits));
+	assert(graph->bits!=NULL);
+	for (int i = 0; i < n; i++) {
+		if (graph->bit_row[i] < 0) {
+			continue;
+		}
+		uint64_t *row = graph->bits + (size_t) graph->bit_row[i] * graph->words;
+		for (long long k = graph->start[i]; k < graph->start[i + 1]; k++) {
+			row[graph->adj[k] / WORD_BITS] |= (uint64_t) 1 << (graph->adj[k] % WORD_BITS);
+		}
+	}
+}
+
+/* return the number of common friends of two users, from their bitset
+ * rows where they have them and from their lists otherwise */
+int count_common_users(graph_t *graph, int user1_id, int user2_id) {
+	int *friends1 = graph->adj + graph->start[user1_id];
+	int *friends2 = graph->adj + graph->start[user2_id];
+	int f1_count = graph->start[user1_id + 1] - graph->start[user1_id];
+	int f2_count = graph->start[user2_id + 1] - graph->start[user2_id];
+	if (graph->bits == NULL) {
+		return count_common(friends1, f1_count, friends2, f2_count);
+	}
+
+	int row1 = graph->bit_row[user1_id], row2 = graph->bit_row[user2_id];
+	uint64_t *bits1 = graph->bits + (size_t) row1 * graph->words;
+	uint64_t *bits2 = graph->bits + (size_t) row2 * graph->words;
+	if (row1 >= 0 && row2 >= 0) {
+		return and_popcount(bits1, bits2, graph->words);
+	} else if (row1 >= 0) {
+		return count_in_row(bits1, friends2, f2_count);
+	} else if (row2 >= 0) {
+		return count_in_row(bits2, friends1, f1_count);
+	}
+	return count_common(friends1, f1_count, friends2, f2_count);
+}
+
+/* return the number of items of an array that are set in a bitset row */
+int count_in_row(uint64_t row[], int arr[], int count) {
+	int n = 0;
+	for (int i = 0; i < count; i++) {
+		n += (row[arr[i] / WORD_BITS] >> (arr[i] % WORD_BITS)) & 1;
+	}
+	return n;
+}
+
+/* return the number of bits set in both of two bitset rows. AVX-512
+ * counts 512 bits at a time, AVX2 256 bits by looking the count of
+ * every 4 bits up in a table */
+int and_popcount(uint64_t row1[], uint64_t row2[], int words) {
+	long long n = 0;
+	int i = 0;
+
+#if defined(__AVX512F__) && defined(__AVX512VPOPCNTDQ__)
+	__m512i sum = _mm512_setzero_si512();
+	for (; i + 8 <= words; i += 8) {
+		__m512i both = _mm512_and_si512(_mm512_loadu_si512(row1 + i),
+			_mm512_loadu_si512(row2 + i));
+		sum = _mm512_add_epi64(sum, _mm512_popcnt_epi64(both));
+	}
+	n += _mm512_reduce_add_epi64(sum);
+#elif defined(__AVX2__)
+	const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+		0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i low = _mm256_set1_epi8(0x0f);
+	__m256i sum = _mm256_setzero_si256();
+	for (; i + 4 <= words; i += 4) {
+		__m256i both = _mm256_and_si256(_mm256_loadu_si256((__m256i*) (row1 + i)),
+			_mm256_loadu_si256((__m256i*) (row2 + i)));
+		__m256i counts = _mm256_add_epi8(
+			_mm256_shuffle_epi8(table, _mm256_and_si256(both, low)),
+			_mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(both, 4), low)));
+		sum = _mm256_add_epi64(sum, _mm256_sad_epu8(counts, _mm256_setzero_si256()));
+	}
+	n += _mm256_extract_epi64(sum, 0) + _mm256_extract_epi64(sum, 1)
+		+ _mm256_extract_epi64(sum, 2) + _mm256_extract_epi64(sum, 3);
+#endif
+
+	for (; i < words; i++) {
+		n += __builtin_popcountll(row1[i] & row2[i]);
+	}
+	return n;
+}
+
+/****************************************************************/
+/* hashtags by interned id */
+
+/* return the id of a hashtag, giving it the next id if it is new */
+int intern_tag(dict_t *dict, char *tag) {
+	/* keep the index at most half full */
+	if (2 * (dict->len + 1) > dict->slot_cap) {
+		free(dict->slots);
+		dict->slot_cap = dict->slot_cap > 0 ? dict->slot_cap * 2 : 2 * INIT_CAPACITY;
+		dict->slots = (int*)malloc(sizeof(*dict->slots) * dict->slot_cap);
+		assert(dict->slots!=NULL);
+		memset(dict->slots, -1, sizeof(*dict->slots) * dict->slot_cap);
+		for (int id = 0; id < dict->len; id++) {
+			unsigned slot = hash_tag(tag_name(dict, id)) & (dict->slot_cap - 1);
+			while (dict->slots[slot] >= 0) {
+				slot = (slot + 1) & (dict->slot_cap - 1);
+			}
+			dict->slots[slot] = id;
+		}
+	}
+
+	unsigned slot = hash_tag(tag) & (dict->slot_cap - 1);
+	while (dict->slots[slot] >= 0) {
+		if (strcmp(tag_name(dict, dict->slots[slot]), tag) == 0) {
+			return dict->slots[slot];
+		}
+		slot = (slot + 1) & (dict->slot_cap - 1);
+	}
+
+	/* a new hashtag, appended to the arena */
+	long long bytes = strlen(tag) + 1;
+	if (dict->used + bytes > dict->size) {
+		dict->size = dict->size > 0 ? dict->size * 2 : INIT_CAPACITY * MAX_TAG_LENGTH;
+		dict->arena = (char*)realloc(dict->arena, dict->size);
+		assert(dict->arena!=NULL);
+	}
+	if (dict->len == dict->cap) {
+		dict->cap = dict->cap > 0 ? dict->cap * 2 : INIT_CAPACITY;
+		dict->offset = (long long*)realloc(dict->offset, sizeof(*dict->offset) * dict->cap);
+		assert(dict->offset!=NULL);
+	}
+	memcpy(dict->arena + dict->used, tag, bytes);
+	dict->offset[dict->len] = dict->used;
+	dict->used += bytes;
+	dict->slots[slot] = dict->len;
+	return dict->len++;
+}
+
+/* the hashtag with an id */
+char *tag_name(dict_t *dict, int id) {
+	return dict->arena + dict->offset[id];
+}
+
+/* FNV-1a hash of a hashtag */
+unsigned hash_tag(char *tag) {
+	unsigned hash = 2166136261u;
+	for (; *tag; tag++) {
+		hash = (hash ^ (unsigned char) *tag) * 16777619u;
+	}
+	return hash;
+}
+
+/* sort the hashtags once, so that a community only sorts integers */
+void rank_tags(dict_t *dict) {
+	dict->rank = (int*)malloc_array(dict->len, sizeof(*dict->rank));
+	dict->by_rank = (int*)malloc_array(dict->len, sizeof(*dict->by_rank));
+	assert(dict->rank!=NULL && dict->by_rank!=NULL);
+	for (int id = 0; id < dict->len; id++) {
+		dict->by_rank[id] = id;
+	}
+	sort_dict = dict;
+	qsort(dict->by_rank, dict->len, sizeof(*dict->by_rank), cmp_name);
+	for (int r = 0; r < dict->len; r++) {
+		dict->rank[dict->by_rank[r]] = r;
+	}
+}
+
+/* compare the hashtags of two ids, for qsort */
+int cmp_name(const void *x1, const void *x2) {
+	return strcmp(tag_name(sort_dict, *(const int*)x1), tag_name(sort_dict, *(const int*)x2));
+}
+
+/* an empty set over tag_count hashtags */
+void make_tag_set(tag_set_t *set, int tag_count) {
+	set->bits = (uint64_t*)calloc((tag_count + WORD_BITS - 1) / WORD_BITS + 1,
+		sizeof(*set->bits));
+	set->ranks = (int*)malloc_array(tag_count, sizeof(*set->ranks));
+	assert(set->bits!=NULL && set->ranks!=NULL);
+	set->len = 0;
+}
+
+/* add the hashtags of a user to the set, each one only once */
+void add_tag_ids(tag_set_t *set, dict_t *dict, user_t *user) {
+	for (int i = 0; i < user->tag_count; i++) {
+		int r = dict->rank[user->tags[i]];
+		uint64_t bit = (uint64_t) 1 << (r % WORD_BITS);
+		if (!(set->bits[r / WORD_BITS] & bit)) {
+			set->bits[r / WORD_BITS] |= bit;
+			set->ranks[set->len++] = r;
+		}
+	}
+}
+
+/* print the hashtags of the set in alphabetical order the way
+ * print_list does, then empty the set */
+void print_tag_set(tag_set_t *set, dict_t *dict) {
+	qsort(set->ranks, set->len, sizeof(*set->ranks), cmp_int);
+	for (int i = 0; i < set->len; i++) {
+		printf("#%s", tag_name(dict, dict->by_rank[set->ranks[i]]));
+		printf(i == set->len - 1 || i % 5 == 4 ? "\n" : " ");
+		set->bits[set->ranks[i] / WORD_BITS] = 0;
+	}
+	set->len = 0;
+}
+
+/* free the memory held by the hashtags */
+void free_tags(dict_t *dict, tag_set_t *set) {
+	free(dict->arena);
+	free(dict->offset);
+	free(dict->rank);
+	free(dict->by_rank);
+	free(dict->slots);
+	free(set->bits);
+	free(set->ranks);
+	memset(dict, 0, sizeof(*dict));
+	memset(set, 0, sizeof(*set));
+}
+
+/* report the memory the hashtags of the users take as interned ids,
+ * against a fixed array of MAX_TAGS strings for each of them, then what
+ * the lists of stage 4 cost */
+void report_memory(user_arr_t *users, dict_t *dict, double stage_four_time) {
+	printf(MEMORY_HEADER);
+
+	long long tags = 0, slots = 0;
+	for (int i = 0; i < users->cap; i++) {
+		tags += users->items[i].tag_count;
+		slots += users->items[i].tag_cap;
+	}
+	long long strings = (long long) users->len * MAX_TAGS * sizeof(data_t);
+	long long ids = slots * sizeof(*users->items->tags);
+	long long table = dict->size + dict->cap * sizeof(*dict->offset)
+		+ dict->slot_cap * sizeof(*dict->slots);
+	if (dict->rank) {
+		table += dict->len * (sizeof(*dict->rank) + sizeof(*dict->by_rank));
+	}
+	double per_user = users->len > 0 ? 1.0 / users->len : 0;
+
+	printf("Hashtags: %lld, distinct: %d, arena bytes in use: %lld\n",
+		tags, dict->len, dict->used);
+	printf("Bytes per user as strings: %.1f\n", strings * per_user);
+	printf("Bytes per user as ids: %.1f, with the dictionary: %.1f\n",
+		ids * per_user, (ids + table) * per_user);
+	printf("Bytes saved per user: %.1f\n", (strings - ids - table) * per_user);
+	printf("Stage 4 lists: %lld mallocs, %lld frees, %s\n", list_mallocs, list_frees,
+		use_arena ? "arena" : "malloc and free per node");
+	printf("Stage 4 time: %.4f s\n", stage_four_time);
+	if (use_cache) {
+		long long total = comm_cache.hits + comm_cache.misses;
+		double miss_time = comm_cache.misses > 0 ? comm_cache.miss_time / comm_cache.misses : 0;
+		printf("Communities: %lld, distinct: %lld, reused: %.1f%%, time saved: about %.4f s\n",
+			total, comm_cache.misses, total > 0 ? 100.0 * comm_cache.hits / total : 0,
+			comm_cache.hits * miss_time);
+	}
+	printf("\n");
+}
+
+/****************************************************************/
+/* arena of the lists of stage 4 */
+
+/* allocate memory for a list or a node */
+void *list_alloc(size_t bytes) {
+	if (use_arena) {
+		return arena_alloc(&list_arena, bytes);
+	}
+	list_mallocs++;
+	return malloc(bytes);
+}
+
+/* free memory of a list or a node. the arena only takes back its latest
+ * allocation, the rest waits for the reset */
+void list_free(void *ptr) {
+	if (use_arena) {
+		arena_undo(&list_arena, ptr);
+		return;
+	}
+	list_frees++;
+	free(ptr);
+}
+
+/* hand out memory from the current block, moving on to the next block
+ * when it is full and allocating a block only the first time through */
+void *arena_alloc(arena_t *arena, size_t bytes) {
+	size_t align = _Alignof(max_align_t);
+	bytes = (bytes + align - 1) / align * align;
+	assert(bytes <= ARENA_BLOCK);
+	if (arena->count == 0 || arena->used + bytes > ARENA_BLOCK) {
+		if (arena->count > 0) {
+			arena->block++;
+		}
+		if (arena->block == arena->count) {
+			if (arena->count == arena->cap) {
+				arena->cap = arena->cap > 0 ? arena->cap * 2 : INIT_CAPACITY;
+				arena->blocks = (char**)realloc(arena->blocks, sizeof(*arena->blocks) * arena->cap);
+				assert(arena->blocks!=NULL);
+			}
+			arena->blocks[arena->count] = (char*)malloc(ARENA_BLOCK);
+			assert(arena->blocks[arena->count]!=NULL);
+			arena->count++;
+			list_mallocs++;
+		}
+		arena->used = 0;
+	}
+	arena->last = arena->blocks[arena->block] + arena->used;
+	arena->used += bytes;
+	return arena->last;
+}
+
+/* take back the latest allocation */
+void arena_undo(arena_t *arena, void *ptr) {
+	if (ptr != NULL && ptr == arena->last) {
+		arena->used = (char*)ptr - arena->blocks[arena->block];
+		arena->last = NULL;
+	}
+}
+
+/* give back everything handed out, keeping the blocks */
+void arena_reset(arena_t *arena) {
+	arena->block = 0;
+	arena->used = 0;
+	arena->last = NULL;
+}
+
+/* free the blocks of the arena */
+void free_arena(arena_t *arena) {
+	for (int i = 0; i < arena->count; i++) {
+		free(arena->blocks[i]);
+		list_frees++;
+	}
+	free(arena->blocks);
+	memset(arena, 0, sizeof(*arena));
+}
+
+/****************************************************************/
+/* communities of stage 4 */
+
+/* print the close friends and the hashtags of the community of a core
+ * user, gathering the hashtags only if no earlier core user had the
+ * same community. the friends are in order */
+void print_community(user_t users[], int core, int friends[], int count) {
+	cache_t *cache = &comm_cache;
+	for (int k = 0; k < count; k++) {
+		printf(" u%d", friends[k]);
+	}
+	printf("\nStage 4.2. Hashtags:\n");
+
+	/* the members in order, at the end of the pool until it is known
+	 * whether they are new */
+	cache->members = grow_ints(cache->members, &cache->member_cap,
+		cache->member_len + count + 1);
+	int *members = cache->members + cache->member_len;
+	int m = 0;
+	for (int k = 0; k <= count; k++) {
+		if (m == k && (k == count || friends[k] > core)) {
+			members[m++] = core;
+		}
+		if (k < count) {
+			members[m++] = friends[k];
+		}
+	}
+	unsigned hash = hash_members(members, m);
+
+	int found = find_community(cache, members, m, hash);
+	if (found >= 0) {
+		cache->hits++;
+	} else {
+		double start = now_sec();
+		list_t *tags = make_empty_list();
+		long long bound = 0;
+		for (int k = 0; k < m; k++) {
+			tags = insert_tags(tags, &users[members[k]]);
+			bound += users[members[k]].tag_count;
+		}
+		cache->tags = grow_ints(cache->tags, &cache->tag_cap, cache->tag_len + bound);
+		found = add_community(cache, members, m, hash);
+		cache->items[found].tag_count = gather_tags(tags, cache->tags + cache->tag_len);
+		cache->tag_len += cache->items[found].tag_count;
+		free_list(tags);
+		cache->misses++;
+		cache->miss_time += now_sec() - start;
+	}
+
+	community_t *community = &cache->items[found];
+	print_tag_ids(&tag_dict, cache->tags + community->tags, community->tag_count);
+}
+
+/* FNV-1a hash of the members of a community */
+unsigned hash_members(int members[], int count) {
+	unsigned hash = 2166136261u;
+	for (int i = 0; i < count; i++) {
+		hash = (hash ^ (unsigned) members[i]) * 16777619u;
+	}
+	return hash;
+}
+
+/* return the community with these members, or -1 if there is none */
+int find_community(cache_t *cache, int members[], int count, unsigned hash) {
+	if (cache->slot_cap == 0) {
+		return -1;
+	}
+	unsigned slot = hash & (cache->slot_cap - 1);
+	while (cache->slots[slot] >= 0) {
+		community_t *community = &cache->items[cache->slots[slot]];
+		if (community->hash == hash && community->member_count == count
+				&& memcmp(cache->members + community->members, members,
+					sizeof(*members) * count) == 0) {
+			return cache->slots[slot];
+		}
+		slot = (slot + 1) & (cache->slot_cap - 1);
+	}
+	return -1;
+}
+
+/* add a community whose members are at the end of the member pool,
+ * with its hashtags to follow at the end of the tag pool */
+int add_community(cache_t *cache, int members[], int count, unsigned hash) {
+	/* keep the index at most half full */
+	if (2 * (cache->len + 1) > cache->slot_cap) {
+		free(cache->slots);
+		cache->slot_cap = cache->slot_cap > 0 ? cache->slot_cap * 2 : 2 * INIT_CAPACITY;
+		cache->slots = (int*)malloc(sizeof(*cache->slots) * cache->slot_cap);
+		assert(cache->slots!=NULL);
+		memset(cache->slots, -1, sizeof(*cache->slots) * cache->slot_cap);
+		for (int i = 0; i < cache->len; i++) {
+			unsigned slot = cache->items[i].hash & (cache->slot_cap - 1);
+			while (cache->slots[slot] >= 0) {
+				slot = (slot + 1) & (cache->slot_cap - 1);
+			}
+			cache->slots[slot] = i;
+		}
+	}
+	if (cache->len == cache->cap) {
+		cache->cap = cache->cap > 0 ? cache->cap * 2 : INIT_CAPACITY;
+		cache->items = (community_t*)realloc(cache->items, sizeof(*cache->items) * cache->cap);
+		assert(cache->items!=NULL);
+	}
+
+	community_t *community = &cache->items[cache->len];
+	community->hash = hash;
+	community->members = members - cache->members;
+	community->member_count = count;
+	community->tags = cache->tag_len;
+	community->tag_count = 0;
+	cache->member_len += count;
+
+	unsigned slot = hash & (cache->slot_cap - 1);
+	while (cache->slots[slot] >= 0) {
+		slot = (slot + 1) & (cache->slot_cap - 1);
+	}
+	cache->slots[slot] = cache->len;
+	return cache->len++;
+}
+
+/* write the ids of the hashtags gathered for a community to out in
+ * alphabetical order, from the set with -g and from the list otherwise.
+ * returns how many there are */
+int gather_tags(list_t *tags, int out[]) {
+	int count = 0;
+	if (use_tag_ids) {
+		qsort(tag_set.ranks, tag_set.len, sizeof(*tag_set.ranks), cmp_int);
+		for (int i = 0; i < tag_set.len; i++) {
+			out[count++] = tag_dict.by_rank[tag_set.ranks[i]];
+			tag_set.bits[tag_set.ranks[i] / WORD_BITS] = 0;
+		}
+		tag_set.len = 0;
+	} else {
+		for (node_t *curr = tags->head; curr; curr = curr->next) {
+			out[count++] = intern_tag(&tag_dict, curr->data);
+		}
+	}
+	return count;
+}
+
+/* print hashtags by id the way print_list does */
+void print_tag_ids(dict_t *dict, int ids[], int count) {
+	for (int i = 0; i < count; i++) {
+		printf("#%s", tag_name(dict, ids[i]));
+		printf(i == count - 1 || i % 5 == 4 ? "\n" : " ");
+	}
+}
+
+/* grow an array of ints to hold at least need of them, doubling it */
+int *grow_ints(int *arr, long long *cap, long long need) {
+	if (need > *cap || arr == NULL) {
+		long long size = *cap > 0 ? *cap : INIT_CAPACITY;
+		while (size < need) {
+			size *= 2;
+		}
+		arr = (int*)realloc(arr, sizeof(*arr) * size);
+		assert(arr!=NULL);
+		*cap = size;
+	}
+	return arr;
+}
+
+/* free the memory held by the communities */
+void free_cache(cache_t *cache) {
+	free(cache->items);
+	free(cache->slots);
+	free(cache->members);
+	free(cache->tags);
+	memset(cache, 0, sizeof(*cache));
+}
+
+/****************************************************************/
+/* threads of stage 3 */
+
+/* compute the strength of connection of every friendship on threads,
+ * with by_edge only from the user with the smaller id. returns the
+ * number of blocks stolen between threads */
+long long compute_edges(graph_t *graph, int by_edge, int threads) {
+	engine_t *engine = (engine_t*)malloc(sizeof(*engine));
+	assert(engine!=NULL);
+	engine->graph = graph;
+	engine->by_edge = by_edge;
+	engine->blocks = (graph->start[graph->n] + BLOCK_EDGES - 1) / BLOCK_EDGES;
+	engine->threads = engine->blocks < threads ? (int) engine->blocks : threads;
+	engine->threads = engine->threads > 0 ? engine->threads : 1;
+
+	/* every thread starts with an equal share of the blocks */
+	for (int t = 0; t < engine->threads; t++) {
+		worker_t *worker = &engine->workers[t];
+		worker->engine = engine;
+		worker->id = t;
+		worker->next = engine->blocks * t / engine->threads;
+		worker->end = engine->blocks * (t + 1) / engine->threads;
+		worker->stolen = 0;
+		pthread_mutex_init(&worker->lock, NULL);
+	}
+	for (int t = 1; t < engine->threads; t++) {
+		worker_t *worker = &engine->workers[t];
+		if (pthread_create(&worker->thread, NULL, engine_worker, worker) != 0) {
+			fprintf(stderr, "cannot start stage 3 thread\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	engine_worker(&engine->workers[0]);
+
+	long long stolen = engine->workers[0].stolen;
+	for (int t = 1; t < engine->threads; t++) {
+		pthread_join(engine->workers[t].thread, NULL);
+		stolen += engine->workers[t].stolen;
+	}
+	for (int t = 0; t < engine->threads; t++) {
+		pthread_mutex_destroy(&engine->workers[t].lock);
+	}
+	free(engine);
+	return stolen;
+}
+
+/* compute blocks until there are none left to take or steal */
+void *engine_worker(void *arg) {
+	worker_t *worker = (worker_t*)arg;
+	long long block;
+	while (engine_take(worker->engine, worker, &block)) {
+		compute_block(worker->engine->graph, block, worker->engine->by_edge);
+	}
+	return NULL;
+}
+
+/* take the next block of the worker, or steal half of the blocks left
+ * to the first other worker that has any. blocks are never added, so
+ * there is no work left once every worker is empty */
+int engine_take(engine_t *engine, worker_t *worker, long long *block) {
+	pthread_mutex_lock(&worker->lock);
+	int found = worker->next < worker->end;
+	if (found) {
+		*block = worker->next++;
+	}
+	pthread_mutex_unlock(&worker->lock);
+
+	for (int t = 1; !found && t < engine->threads; t++) {
+		worker_t *victim = &engine->workers[(worker->id + t) % engine->threads];
+		pthread_mutex_lock(&victim->lock);
+		long long left = victim->end - victim->next;
+		long long next = victim->end - (left + 1) / 2, end = victim->end;
+		if (left > 0) {
+			victim->end = next;
+		}
+		pthread_mutex_unlock(&victim->lock);
+
+		if (left > 0) {
+			pthread_mutex_lock(&worker->lock);
+			*block = next;
+			worker->next = next + 1;
+			worker->end = end;
+			worker->stolen += end - next;
+			pthread_mutex_unlock(&worker->lock);
+			found = 1;
+		}
+	}
+	return found;
+}
+
+/* compute the friendships of a block. a block may cover part of the
+ * friends of a user with many of them, so those are shared out too */
+void compute_block(graph_t *graph, long long block, int by_edge) {
+	long long lo = block * BLOCK_EDGES;
+	long long hi = lo + BLOCK_EDGES < graph->start[graph->n] ? lo + BLOCK_EDGES
+		: graph->start[graph->n];
+
+	/* the user whose friends include lo */
+	int first = 0, last = graph->n;
+	while (first < last) {
+		int mid = (first + last) / 2;
+		if (graph->start[mid + 1] <= lo) {
+			first = mid + 1;
+		} else {
+			last = mid;
+		}
+	}
+
+	int i = first;
+	for (long long k = lo; k < hi; k++) {
+		while (graph->start[i + 1] <= k) {
+			i++;
+		}
+		if (!by_edge) {
+			graph->soc[k] = compute_soc_sparse(graph, i, graph->adj[k]);
+		} else if (graph->adj[k] > i) {
+			graph->soc[k] = soc_of_friends(graph, i, graph->adj[k]);
+		}
+	}
+}
+
+/* copy the strength of every friendship computed from the user with
+ * the smaller id to the other user. the users are visited in order, so
+ * the friends of user j with smaller ids are reached in the order j
+ * lists them */
+void mirror_edges(graph_t *graph) {
+	int n = graph->n;
+	long long *next = (long long*)malloc_array(n, sizeof(*next));
+	assert(next!=NULL);
+	memcpy(next, graph->start, sizeof(*next) * n);
+	for (int i = 0; i < n; i++) {
+		for (long long k = graph->start[i]; k < graph->start[i + 1]; k++) {
+			if (graph->adj[k] > i) {
+				graph->soc[next[graph->adj[k]]++] = graph->soc[k];
+			}
+		}
+	}
+	free(next);
+}
+
+/* time stage 3 on 1 to threads threads, doubling them, and check that
+ * every run gives the same strengths as the first. the blocks are
+ * also timed one by one on this thread, to give the speedups t cores
+ * would allow: with the starting split alone, a share per thread, and
+ * with the stealing at its best, the blocks spread evenly up to the
+ * biggest one. the mirroring stays serial in both */
+void bench_threads(graph_t *graph, int by_edge, int threads) {
+	long long entries = graph->start[graph->n];
+	float *expected = (float*)malloc_array(entries, sizeof(*expected));
+	assert(expected!=NULL);
+	memcpy(expected, graph->soc, sizeof(*expected) * entries);
+
+	long long blocks = (entries + BLOCK_EDGES - 1) / BLOCK_EDGES;
+	double *cost = (double*)malloc_array(blocks, sizeof(*cost));
+	assert(cost!=NULL);
+	double total = 0, biggest = 0;
+	for (long long b = 0; b < blocks; b++) {
+		double start = now_sec();
+		compute_block(graph, b, by_edge);
+		cost[b] = now_sec() - start;
+		total += cost[b];
+		biggest = cost[b] > biggest ? cost[b] : biggest;
+	}
+	double serial = now_sec();
+	if (by_edge) {
+		mirror_edges(graph);
+	}
+	serial = now_sec() - serial;
+
+	double one_time = 0;
+	for (int t = 1; t <= threads; t = t < threads && 2 * t > threads ? threads : 2 * t) {
+		memset(graph->soc, 0, sizeof(*graph->soc) * entries);
+		double start = now_sec();
+		long long stolen = compute_edges(graph, by_edge, t);
+		if (by_edge) {
+			mirror_edges(graph);
+		}
+		double time = now_sec() - start;
+
+		/* the shares compute_edges starts the threads with */
+		int shares = blocks < t ? (int) blocks : t;
+		double longest = 0;
+		for (int w = 0; w < shares; w++) {
+			double share = 0;
+			for (long long b = blocks * w / shares; b < blocks * (w + 1) / shares; b++) {
+				share += cost[b];
+			}
+			longest = share > longest ? share : longest;
+		}
+
+		double even = total / shares > biggest ? total / shares : biggest;
+
+		one_time = t == 1 ? time : one_time;
+		printf("Threads %2d: %8.4f s (%5.2fx; split %5.2fx, stealing %5.2fx), "
+			"%lld of %lld blocks stolen%s\n", t, time, one_time / time,
+			(total + serial) / (longest + serial), (total + serial) / (even + serial),
+			stolen, blocks,
+			memcmp(expected, graph->soc, sizeof(*expected) * entries) == 0 ? ""
+				: ", MISMATCH");
+	}
+	printf("\n");
+	free(expected);
+	free(cost);
+}
+
 /****************************************************************/
 /* functions provided, adapt them as appropriate */
 
@@ -350,27 +2147,32 @@ list_t
 *make_empty_list(void) {
 	list_t *list;
 
-	list = (list_t*)malloc(sizeof(*list));
+	list = (list_t*)list_alloc(sizeof(*list));
 	assert(list!=NULL);
 	list->head = list->foot = NULL;
 
 	return list;
 }
 
-/* free the memory allocated for a list (and its nodes) */
+/* free the memory allocated for a list (and its nodes), with -a by
+ * resetting the arena */
 void
 free_list(list_t *list) {
 	node_t *curr, *prev;
 
 	assert(list!=NULL);
+	if (use_arena) {
+		arena_reset(&list_arena);
+		return;
+	}
 	curr = list->head;
 	while (curr) {
 		prev = curr;
 		curr = curr->next;
-		free(prev);
+		list_free(prev);
 	}
 
-	free(list);
+	list_free(list);
 }
 
 /* insert a new data element into a linked list, keeping the
@@ -378,7 +2180,7 @@ free_list(list_t *list) {
 */
 list_t
 *insert_unique_in_order(list_t *list, data_t value) {
-	node_t *new = (node_t*)malloc(sizeof(*new));
+	node_t *new = (node_t*)list_alloc(sizeof(*new));
 	assert(list!=NULL && new!=NULL);
 	strcpy(new->data, value);
 	new->next = NULL;
@@ -402,7 +2204,7 @@ list_t
 				break;
 			} else if (cmp == 0) {
 				/* abort if value already exists */
-				free(new);
+				list_free(new);
 				new = NULL;
 				break;
 			}
@@ -498,4 +2300,10 @@ print_list(list_t *list) {
 
 	Given constant values of T and H, we can simplify the worst case complexity to:
 	=	O(U^3)
+
+	With -g the hashtags are interned and ranked once after stage 1, in
+	O(TUH log(UH)). A community then sets one bit per hashtag in O(UH),
+	sorts the ranks it set in O(UH log(UH)) and prints them in O(UHT),
+	so all communities take O(U * UH log(UH)) = O(U^2 log U) for constant
+	T and H.
 */
@@ -1,5 +1,49 @@
-gcc -Wall -std=c17 -o program program.c -lm
+gcc -Wall -std=c17 -o program program.c -lm -lpthread
 ./program < test0.txt > output0.txt
 ./program < test1.txt > output1.txt
+./program -e < test2.txt > output2.txt
+./program -e -k naive < test2.txt > output2-naive.txt
+./program -e -k merge < test2.txt > output2-merge.txt
+./program -e -k gallop < test2.txt > output2-gallop.txt
+./program -e -k simd < test2.txt > output2-simd.txt
+./program -b < test0.txt > output0-b.txt
+./program -e -b < test2.txt > output2-b.txt
+./program -E < test0.txt > output0-E.txt
+./program -e -E < test2.txt > output2-E.txt
+./program -t 4 < test0.txt > output0-t.txt
+./program -e -t 4 < test2.txt > output2-t.txt
+./program -e -E -t 4 < test2.txt > output2-Et.txt
+./program -g < test0.txt > output0-g.txt
+./program -g < test1.txt > output1-g.txt
+./program -e -g < test2.txt > output2-g.txt
+./program -a < test0.txt > output0-a.txt
+./program -a < test1.txt > output1-a.txt
+./program -e -a < test2.txt > output2-a.txt
+./program -c < test0.txt > output0-c.txt
+./program -c < test1.txt > output1-c.txt
+./program -e -c < test2.txt > output2-c.txt
+./program -e -a -c -g < test2.txt > output2-acg.txt
 diff output0.txt test0-output.txt
-diff output1.txt test1-output.txt
\ No newline at end of file
+diff output1.txt test1-output.txt
+diff output2.txt test2-output.txt
+diff output2-naive.txt test2-output.txt
+diff output2-merge.txt test2-output.txt
+diff output2-gallop.txt test2-output.txt
+diff output2-simd.txt test2-output.txt
+diff output0-b.txt test0-output.txt
+diff output2-b.txt test2-output.txt
+diff output0-E.txt test0-output.txt
+diff output2-E.txt test2-output.txt
+diff output0-t.txt test0-output.txt
+diff output2-t.txt test2-output.txt
+diff output2-Et.txt test2-output.txt
+diff output0-g.txt test0-output.txt
+diff output1-g.txt test1-output.txt
+diff output2-g.txt test2-output.txt
+diff output0-a.txt test0-output.txt
+diff output1-a.txt test1-output.txt
+diff output2-a.txt test2-output.txt
+diff output0-c.txt test0-output.txt
+diff output1-c.txt test1-output.txt
+diff output2-c.txt test2-output.txt
+diff output2-acg.txt test2-output.txt
\ No newline at end of file